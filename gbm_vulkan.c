@@ -1,39 +1,391 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <assert.h>
 #include <sys/sysmacros.h>
 #include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
 #include <xf86drm.h>
+#include <xf86drmMode.h>
 #include <errno.h>
 #include <drm_fourcc.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+#include <linux/sync_file.h>
+#include <linux/udmabuf.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "gbm_backend_abi.h"
+#include "gbm_vulkan.h"
+#include "vulkan_tiling.h"
 
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_core.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+static uint64_t get_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// How often tracing_on is re-read while tracing is enabled
+#define VULKAN_TRACE_POLL_NS 1000000000ull
+
+// ftrace trace_marker and tracing_on, opened by the first device created
+// with GBM_VULKAN_TRACE and kept for the life of the process. The marker is
+// -1 while tracing is off, tracing_on -1 if it could not be opened.
+static atomic_int vulkan_trace_fd = -1;
+#if VULKAN_GBM_TRACING
+static atomic_int vulkan_trace_on_fd = -1;
+// Whether tracing_on read 1 when last checked, and when to check it next
+static atomic_bool vulkan_trace_recording = true;
+static atomic_uint_least64_t vulkan_trace_next_poll_ns;
+
+// Follows tracing_on, so that starting and stopping a capture turns events
+// on and off without restarting the process
+static bool vulkan_trace_poll(void) {
+	uint64_t now = get_time_ns();
+	uint64_t next = atomic_load_explicit(&vulkan_trace_next_poll_ns, memory_order_relaxed);
+	if (now < next || !atomic_compare_exchange_strong_explicit(&vulkan_trace_next_poll_ns,
+			&next, now + VULKAN_TRACE_POLL_NS, memory_order_relaxed, memory_order_relaxed)) {
+		// Not due yet, or another thread is re-reading it
+		return atomic_load_explicit(&vulkan_trace_recording, memory_order_relaxed);
+	}
+	int fd = atomic_load_explicit(&vulkan_trace_on_fd, memory_order_relaxed);
+	char value;
+	bool recording = fd < 0 || pread(fd, &value, 1, 0) != 1 || value != '0';
+	atomic_store_explicit(&vulkan_trace_recording, recording, memory_order_relaxed);
+	return recording;
+}
+#endif
+
+static inline bool vulkan_trace_enabled(void) {
+#if VULKAN_GBM_TRACING
+	if (__builtin_expect(atomic_load_explicit(&vulkan_trace_fd, memory_order_relaxed) < 0, 1)) {
+		return false;
+	}
+	return vulkan_trace_poll();
+#else
+	return false;
+#endif
+}
+
+__attribute__((format(printf, 2, 3)))
+static void vulkan_trace_write(char kind, const char *fmt, ...) {
+	char buf[256];
+	int len = snprintf(buf, sizeof(buf), "%c|%d|", kind, (int)getpid());
+	va_list args;
+	va_start(args, fmt);
+	int msg_len = vsnprintf(buf + len, sizeof(buf) - len, fmt, args);
+	va_end(args);
+	if (msg_len < 0) {
+		return;
+	}
+	len = len + msg_len < (int)sizeof(buf) ? len + msg_len : (int)sizeof(buf) - 1;
+	// A failed write only loses the event
+	ssize_t written = write(atomic_load_explicit(&vulkan_trace_fd, memory_order_relaxed), buf, len);
+	(void)written;
+}
+
+// Closes the innermost slice. Perfetto ignores anything after the pid of an
+// end event, so outcomes go in an instant event just before it.
+static void vulkan_trace_write_end(void) {
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "E|%d", (int)getpid());
+	ssize_t written = write(atomic_load_explicit(&vulkan_trace_fd, memory_order_relaxed), buf, len);
+	(void)written;
+}
+
+// Begin and end events in the atrace format, which Perfetto and trace-cmd
+// pick up from trace_marker alongside KMS and GPU events. The end macro
+// records its arguments as an instant event inside the slice. With tracing
+// off, each costs a single branch, and nothing at all when built without it.
+#define vulkan_trace_begin(...) do { \
+		if (vulkan_trace_enabled()) { \
+			vulkan_trace_write('B', __VA_ARGS__); \
+		} \
+	} while (0)
+#define vulkan_trace_end(...) do { \
+		if (vulkan_trace_enabled()) { \
+			vulkan_trace_write('I', __VA_ARGS__); \
+			vulkan_trace_write_end(); \
+		} \
+	} while (0)
+
 static const struct gbm_core *core;
 
+enum vulkan_modifier_class {
+	VULKAN_MODIFIER_COMPRESSED,
+	VULKAN_MODIFIER_TILED,
+	VULKAN_MODIFIER_LINEAR,
+	VULKAN_MODIFIER_CLASS_COUNT,
+};
+
+static const char *const vulkan_modifier_class_names[] = {
+	[VULKAN_MODIFIER_COMPRESSED] = "compressed",
+	[VULKAN_MODIFIER_TILED] = "tiled",
+	[VULKAN_MODIFIER_LINEAR] = "linear",
+};
+
+// GPU copies run on a single queue, a transfer-only one when the device has
+// it. Command and staging buffers live in a ring of slots, each recycled once
+// the timeline semaphore has passed the point of its last submission, so a
+// copy costs no more setup than recording and submitting it.
+#define VULKAN_COPY_SLOT_COUNT 8
+// Slots that asynchronous readbacks may hold at once, the rest stay free
+// for blocking copies
+#define VULKAN_COPY_MAX_HELD (VULKAN_COPY_SLOT_COUNT - 2)
+// BOs a single copy reads or writes
+#define VULKAN_COPY_MAX_ACCESSES 2
+
+struct vulkan_staging {
+	VkBuffer buffer;
+	VkDeviceMemory memory;
+	VkDeviceSize size;
+	char *map;
+};
+
+struct vulkan_copy_slot {
+	VkCommandBuffer cb;
+	// Timeline point of the last submission recorded in this slot
+	uint64_t point;
+	// Held by an asynchronous readback until it is released
+	bool held;
+	// Binary semaphore exported as a sync_file, created on first use
+	VkSemaphore fence;
+	// The fence was signaled but could not be exported, so it has to be
+	// recreated before it is signaled again
+	bool fence_stale;
+	// Binary semaphores the implicit fences of the BOs are imported into,
+	// created on first use
+	VkSemaphore waits[VULKAN_COPY_MAX_ACCESSES];
+	struct vulkan_staging staging;
+};
+
+struct vulkan_copy_engine {
+	bool enabled;
+	uint32_t queue_family;
+	// Family that BOs are released to and acquired from between copies
+	uint32_t foreign_queue_family;
+	VkQueue queue;
+	VkCommandPool pool;
+	VkSemaphore timeline;
+	uint64_t last_point;
+	uint32_t next_slot;
+	uint32_t held_count;
+	// Whether submissions can wait for and signal sync_files
+	bool has_sync_fd;
+	// Cleared when the kernel lacks DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+	bool dmabuf_sync_file;
+	struct vulkan_copy_slot slots[VULKAN_COPY_SLOT_COUNT];
+};
+
+struct vulkan_pixel_conversion;
+
+// With GBM_VULKAN_DEFERRED_DESTROY, BOs are torn down on a background
+// thread. Freeing large allocations can take a while in the kernel, which
+// is better not spent in the caller's frame loop. The queue is bounded, and
+// destroying blocks while it is full.
+#define VULKAN_RECLAIM_QUEUE_DEPTH 64
+
+// BOs created ahead of time by a worker thread, on request through
+// gbm_vulkan_device_prewarm or when allocation patterns predict them. All
+// ready BOs share one configuration, and they are limited by count and by a
+// byte budget. Off unless a budget is configured, as BOs created for a
+// misprediction are wasted memory and allocator time.
+#define VULKAN_WARM_MAX_BOS 8
+#define VULKAN_WARM_DEFAULT_BUDGET_MIB 0
+
+struct vulkan_warm_key {
+	uint32_t width, height, format, usage;
+	unsigned modifier_count;
+	uint64_t *modifiers;
+};
+
+struct vulkan_warm_pool {
+	// 0 if disabled
+	uint64_t budget;
+	bool started, stopping;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// Latest request, replacing any the worker has not picked up yet
+	struct vulkan_warm_key pending;
+	uint32_t pending_count;
+	struct vulkan_warm_key ready_key;
+	struct gbm_vulkan_bo *ready[VULKAN_WARM_MAX_BOS];
+	uint32_t ready_count;
+	uint64_t ready_bytes;
+	// Last allocated configuration, as a hash of everything but the size,
+	// and how many BOs in a row were allocated with it
+	uint64_t last_hash;
+	uint32_t last_width, last_height;
+	uint32_t run;
+};
+
+// Memory of destroyed BOs, kept for a short while for new BOs that fit in
+// it, so that interactive resizes do not go back to the kernel allocator
+// for every frame. Like the BO caches of the Mesa drivers, it only takes
+// memory that was never exported, which nobody else can still be using.
+// Entries are freed by a background thread once they expire, so memory
+// does not stay cached when no BOs are created or destroyed anymore.
+#define VULKAN_MEMORY_CACHE_SIZE 4
+#define VULKAN_MEMORY_CACHE_MAX_AGE_NS 1000000000ull
+
+struct vulkan_cached_memory {
+	VkDeviceMemory memory;
+	VkDeviceSize size;
+	uint32_t mem_type;
+	uint64_t modifier;
+	uint64_t released_ns;
+};
+
+struct vulkan_memory_cache {
+	pthread_mutex_t lock;
+	// On CLOCK_MONOTONIC, signaled when entries are added and on shutdown
+	pthread_cond_t cond;
+	// Expiry thread, started along with the first entry
+	pthread_t thread;
+	bool started, stopping;
+	struct vulkan_cached_memory entries[VULKAN_MEMORY_CACHE_SIZE];
+	uint32_t count;
+};
+
+// Mirrors struct gbm_vulkan_stats, updated with relaxed atomics
+struct vulkan_stats {
+	atomic_uint_least64_t live_bos;
+	atomic_uint_least64_t peak_live_bos;
+	atomic_uint_least64_t memory_bytes;
+	atomic_uint_least64_t peak_memory_bytes;
+	atomic_uint_least64_t memory_type_bytes[GBM_VULKAN_STATS_MAX_MEMORY_TYPES];
+	atomic_uint_least64_t memory_heap_bytes[GBM_VULKAN_STATS_MAX_MEMORY_HEAPS];
+	atomic_uint_least64_t creates;
+	atomic_uint_least64_t imports;
+	atomic_uint_least64_t exports;
+	atomic_uint_least64_t maps;
+	atomic_uint_least64_t warm_pool_hits;
+	atomic_uint_least64_t warm_pool_misses;
+	atomic_uint_least64_t memory_cache_hits;
+	atomic_uint_least64_t memory_cache_misses;
+	atomic_uint_least64_t latency[GBM_VULKAN_STATS_OP_COUNT][GBM_VULKAN_STATS_LATENCY_BUCKETS];
+
+	// Whether to print the stats when the device is destroyed
+	bool dump;
+	// Interval at which operations print the stats, 0 if they do not
+	uint64_t dump_interval_ns;
+	atomic_uint_least64_t next_dump_ns;
+};
+
+struct vulkan_reclaimer {
+	bool enabled;
+	bool stopping;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full;
+	struct gbm_vulkan_bo *queue[VULKAN_RECLAIM_QUEUE_DEPTH];
+	uint32_t head, count;
+};
+
+// Threading: everything a device holds is written during
+// vulkan_device_create and only read afterwards, except for what the two
+// locks below protect. BOs may be used from any thread, with per-BO state
+// that is set up lazily either published atomically or created under a lock.
 struct gbm_vulkan_device {
         struct gbm_device base;
+        // Serializes the copy engine, which everything copying through the
+        // GPU or the lazily created transfer images goes through
+        pthread_mutex_t copy_lock;
+        // Taken for rare transitions of shared state, such as the first map
+        // and last unmap of a BO, or opening udmabuf, and for the list of
+        // copying maps of a BO
+        pthread_mutex_t lock;
 
         VkInstance instance;
         VkPhysicalDevice physical_device;
         VkDevice device;
+        // Render node of the device, or its primary node if it has none
+        dev_t devid;
+        // All memory of integrated GPUs is system memory
+        bool integrated;
+
+        // Whether scanout BOs go to a separate PRIME display device
+        bool prime_display;
+        dev_t prime_devid;
+        // KMS node of the display device, as configured
+        char *prime_path;
 
         struct vulkan_format_props *format_props;
         uint32_t format_prop_count;
 
+        // Allocation preference per modifier class, lower tiers are tried first
+        uint8_t modifier_class_tier[VULKAN_MODIFIER_CLASS_COUNT];
+        bool debug;
+
+        // Whether the scanout flags of the modifier props come from KMS planes
+        bool has_scanout_info;
+        // Same for the prime flags and the planes of the PRIME display device
+        bool has_prime_scanout_info;
+        // Whether the fd can back CPU-written BOs with dumb buffers
+        bool has_dumb;
+
+        // Optional DMA-BUF heap for linear BOs, -1 if unused
+        int dma_heap_fd;
+        // /dev/udmabuf, opened on first shm import, -1 until then
+        int udmabuf_fd;
+        uint32_t dma_heap_usage;
+        bool dma_heap_sampled;
+        // Number of BOs in each gbm_surface
+        uint32_t surface_buffers;
+        struct vulkan_reclaimer reclaimer;
+        struct vulkan_warm_pool warm;
+        struct vulkan_memory_cache memory_cache;
+        struct vulkan_stats stats;
+        // Source of the BO ids in trace events
+        atomic_uint_least64_t next_bo_id;
+
+        VkPhysicalDeviceMemoryProperties mem_props;
+        VkDeviceSize non_coherent_atom_size;
+        struct vulkan_copy_engine copy;
+        // Whether VK_EXT_host_image_copy is enabled
+        bool has_host_copy;
+        // Whether VK_EXT_image_compression_control is enabled
+        bool has_compression_control;
+
+        // Pixel conversion kernel for the CPU we run on
+        void (*convert_row)(uint8_t *dst, const uint8_t *src, size_t pixels,
+                const struct vulkan_pixel_conversion *conv);
+
         struct {
                 PFN_vkGetMemoryFdKHR vkGetMemoryFdKHR;
+                PFN_vkGetMemoryFdPropertiesKHR vkGetMemoryFdPropertiesKHR;
                 PFN_vkGetImageDrmFormatModifierPropertiesEXT vkGetImageDrmFormatModifierPropertiesEXT;
+                PFN_vkWaitSemaphoresKHR vkWaitSemaphoresKHR;
+                PFN_vkGetSemaphoreFdKHR vkGetSemaphoreFdKHR;
+                PFN_vkImportSemaphoreFdKHR vkImportSemaphoreFdKHR;
+                PFN_vkCopyImageToMemoryEXT vkCopyImageToMemoryEXT;
+                PFN_vkCopyMemoryToImageEXT vkCopyMemoryToImageEXT;
+                PFN_vkTransitionImageLayoutEXT vkTransitionImageLayoutEXT;
+                PFN_vkGetImageSubresourceLayout2EXT vkGetImageSubresourceLayout2EXT;
         } api;
 };
 
@@ -50,11 +402,33 @@ struct vulkan_format {
 struct vulkan_format_modifier_props {
 	VkDrmFormatModifierPropertiesEXT props;
 	VkExtent2D max_extent;
+	enum vulkan_modifier_class mod_class;
+	// Supported by at least one KMS plane, see has_scanout_info
+	bool scanout;
+	// Images can be copied from and to host memory by the CPU, see has_host_copy
+	bool host_copy;
+	// Supported by at least one KMS plane of the PRIME display device, see
+	// has_prime_scanout_info
+	bool prime;
 };
 
+// The GBM usage bits we know about all live in the low bits, so a usage
+// combination doubles as a bit index into a 64-bit mask.
+#define VULKAN_USAGE_MASK (GBM_BO_USE_SCANOUT | GBM_BO_USE_CURSOR | GBM_BO_USE_RENDERING | \
+	GBM_BO_USE_WRITE | GBM_BO_USE_LINEAR | GBM_BO_USE_PROTECTED)
+static_assert(VULKAN_USAGE_MASK < 64, "usage combinations must fit in a uint64_t mask");
+
+static inline uint64_t vulkan_usage_bit(uint32_t usage) {
+	return UINT64_C(1) << (usage & VULKAN_USAGE_MASK);
+}
+
 struct vulkan_format_props {
 	struct vulkan_format format;
 
+	// Bit vulkan_usage_bit(usage) is set if allocations with that usage
+	// combination can succeed, disregarding size limits
+	uint64_t supported_usage;
+
 	uint32_t render_mod_count;
 	struct vulkan_format_modifier_props *render_mods;
 	uint32_t texture_mod_count;
@@ -417,6 +791,114 @@ const struct vulkan_format_modifier_props *vulkan_format_props_find_modifier(
 	return NULL;
 }
 
+static enum vulkan_modifier_class vulkan_modifier_classify(const VkDrmFormatModifierPropertiesEXT *m) {
+	uint64_t mod = m->drmFormatModifier;
+	if (mod == DRM_FORMAT_MOD_LINEAR) {
+		return VULKAN_MODIFIER_LINEAR;
+	}
+
+	// All formats we expose are single-plane, so any additional memory
+	// planes hold compression metadata (Intel CCS, AMD displayable DCC, ...)
+	if (m->drmFormatModifierPlaneCount > 1) {
+		return VULKAN_MODIFIER_COMPRESSED;
+	}
+	if (fourcc_mod_is_vendor(mod, ARM)) {
+		uint64_t type = (mod >> 52) & 0xf;
+		if (type == DRM_FORMAT_MOD_ARM_TYPE_AFBC || type == DRM_FORMAT_MOD_ARM_TYPE_AFRC) {
+			return VULKAN_MODIFIER_COMPRESSED;
+		}
+	}
+	if (fourcc_mod_is_vendor(mod, AMD) && AMD_FMT_MOD_GET(DCC, mod)) {
+		return VULKAN_MODIFIER_COMPRESSED;
+	}
+	return VULKAN_MODIFIER_TILED;
+}
+
+static void vulkan_parse_modifier_policy(struct gbm_vulkan_device *dev) {
+	// Default: compressed, then tiled, then linear
+	for (int i = 0; i < VULKAN_MODIFIER_CLASS_COUNT; i++) {
+		dev->modifier_class_tier[i] = i;
+	}
+
+	const char *env = getenv("GBM_VULKAN_MODIFIER_ORDER");
+	if (env == NULL || env[0] == '\0') {
+		return;
+	}
+	if (strcmp(env, "driver") == 0) {
+		// Hand the whole list to the driver in one go
+		memset(dev->modifier_class_tier, 0, sizeof(dev->modifier_class_tier));
+		return;
+	}
+
+	bool seen[VULKAN_MODIFIER_CLASS_COUNT] = {0};
+	uint8_t next_tier = 0;
+	const char *cur = env;
+	while (*cur != '\0') {
+		size_t len = strcspn(cur, ",");
+		bool matched = false;
+		for (int i = 0; i < VULKAN_MODIFIER_CLASS_COUNT; i++) {
+			const char *name = vulkan_modifier_class_names[i];
+			if (strlen(name) == len && strncmp(cur, name, len) == 0) {
+				if (!seen[i]) {
+					seen[i] = true;
+					dev->modifier_class_tier[i] = next_tier++;
+				}
+				matched = true;
+				break;
+			}
+		}
+		if (!matched) {
+			fprintf(stderr, "Ignoring unknown modifier class '%.*s' in GBM_VULKAN_MODIFIER_ORDER\n",
+				(int)len, cur);
+		}
+		cur += len;
+		if (*cur == ',') {
+			cur++;
+		}
+	}
+
+	// Classes not mentioned keep their default relative order, after the listed ones
+	for (int i = 0; i < VULKAN_MODIFIER_CLASS_COUNT; i++) {
+		if (!seen[i]) {
+			dev->modifier_class_tier[i] = next_tier++;
+		}
+	}
+}
+
+struct vulkan_modifier_candidate {
+	const struct vulkan_format_modifier_props *props;
+	unsigned tier;
+};
+
+static unsigned vulkan_modifier_tier(const struct gbm_vulkan_device *dev,
+		const struct vulkan_format_modifier_props *mod, uint32_t usage) {
+	unsigned tier = dev->modifier_class_tier[mod->mod_class] * 2;
+
+	// Display engines frequently lack support for, or need extra setup
+	// for, compressed layouts, so for scanout they only go after tiled
+	// unless a plane told us otherwise.
+	unsigned tiled_tier = dev->modifier_class_tier[VULKAN_MODIFIER_TILED] * 2;
+	if ((usage & GBM_BO_USE_SCANOUT) && mod->mod_class == VULKAN_MODIFIER_COMPRESSED &&
+			!mod->scanout && tier < tiled_tier) {
+		tier = tiled_tier + 1;
+	}
+	return tier;
+}
+
+static void vulkan_rank_modifiers(struct vulkan_modifier_candidate *candidates, size_t count) {
+	// Stable insertion sort, the lists are short and we want to keep the
+	// driver's order within a tier
+	for (size_t i = 1; i < count; i++) {
+		struct vulkan_modifier_candidate cur = candidates[i];
+		size_t j = i;
+		while (j > 0 && candidates[j - 1].tier > cur.tier) {
+			candidates[j] = candidates[j - 1];
+			j--;
+		}
+		candidates[j] = cur;
+	}
+}
+
 static int vulkan_find_mem_type(VkPhysicalDevice phdev,VkMemoryPropertyFlags flags,
 		uint32_t req_bits) {
 	VkPhysicalDeviceMemoryProperties props;
@@ -435,66 +917,299 @@ static int vulkan_find_mem_type(VkPhysicalDevice phdev,VkMemoryPropertyFlags fla
 
 struct gbm_vulkan_bo_import {
         int fds[GBM_MAX_PLANES];
+        // Whether we created the fds and have to close them
+        bool owned;
+};
+
+struct gbm_vulkan_bo_dumb {
+	uint32_t handle;
+	uint64_t size;
+	// Dumb buffers stay mapped for their whole lifetime
+	char *map;
 };
 
 struct gbm_vulkan_bo_mapping {
-	int refcnt;
-	uint32_t stride, bpp;
+	// Taken and dropped without locking while positive. Changes from and
+	// to 0, along with mapping and unmapping, happen with the device lock.
+	atomic_int refcnt;
 	char *map;
 };
 
+// Image for the copy engine, aliasing the BO's memory with transfer usage
+struct gbm_vulkan_bo_transfer {
+	VkImage image;
+	// Memory imported from the dma-buf, for BOs without Vulkan memory
+	VkDeviceMemory memory;
+	VkImageUsageFlags usage;
+	// Timeline point of the last copy involving the BO
+	uint64_t point;
+};
+
+enum gbm_vulkan_map_kind {
+	GBM_VULKAN_MAP_STAGING,
+	GBM_VULKAN_MAP_MEMORY,
+	GBM_VULKAN_MAP_CONVERT,
+};
+
+// Mappings that are not of the BO memory itself start with this, and are
+// listed on their BO until unmapped. The map_data the caller hands back is
+// only dereferenced once it has been found on that list.
+struct gbm_vulkan_map {
+	struct gbm_vulkan_bo *bo;
+	enum gbm_vulkan_map_kind kind;
+	struct gbm_vulkan_map *next;
+};
+
+// Region of a BO mapped through a copy into host memory
+struct gbm_vulkan_bo_staging_map {
+	struct gbm_vulkan_map base;
+	uint32_t x, y, width, height, flags;
+	uint32_t stride;
+	char data[];
+};
+
+// Direct mapping of BO memory that needs more than handing out a pointer:
+// cache maintenance for non-coherent memory, or a bounce buffer for writes
+// to uncached memory
+struct gbm_vulkan_bo_memory_map {
+	struct gbm_vulkan_map base;
+	uint32_t flags;
+	bool coherent, bounce;
+	// Atom-aligned range to invalidate and flush
+	VkDeviceSize offset, size;
+	char *addr;
+	uint32_t row_size, height;
+	// Bounce buffer with tightly packed rows
+	char data[];
+};
+
+#define VULKAN_SURFACE_MAX_BUFFERS 8
+#define VULKAN_SURFACE_DEFAULT_BUFFERS 3
+
+// A gbm_surface is a fixed ring of BOs. Each is either free, the back
+// buffer handed out for rendering, or locked by the client until released.
+struct gbm_vulkan_surface {
+	struct gbm_surface base;
+	uint32_t buffer_count;
+	struct gbm_vulkan_bo *buffers[VULKAN_SURFACE_MAX_BUFFERS];
+	bool locked[VULKAN_SURFACE_MAX_BUFFERS];
+	// Stack of free buffer indices
+	uint32_t free[VULKAN_SURFACE_MAX_BUFFERS];
+	uint32_t free_count;
+	struct gbm_vulkan_bo *back;
+};
+
 struct gbm_vulkan_bo {
         struct gbm_bo base;
         VkImage image;
         VkDeviceMemory memory;
+        VkMemoryPropertyFlags mem_flags;
+        VkDeviceSize mem_size;
+        uint32_t mem_type;
         size_t plane_cnt;
         uint64_t modifier;
 
 	int strides[GBM_MAX_PLANES];
 	int offsets[GBM_MAX_PLANES];
+	// dma-buf of a BO we allocated, owned by the BO. Exported on first use
+	// unless the allocator hands us one, -1 until then.
+	atomic_int export_fd;
+
 	struct gbm_vulkan_bo_import *import;
-	struct gbm_vulkan_bo_mapping *mapping;
+	struct gbm_vulkan_bo_dumb *dumb;
+	struct gbm_vulkan_bo_mapping mapping;
+	// Live mappings other than plain pointers into the memory, under the
+	// device lock
+	struct gbm_vulkan_map *maps;
+	struct gbm_vulkan_bo_transfer *transfer;
+	// CPU mapping of the dma-buf for software (de)tiling, NULL until used
+	char *cpu_map;
+	size_t cpu_map_size;
+	// Surface owning the BO, or NULL
+	struct gbm_vulkan_surface *surface;
+	uint32_t surface_index;
+	// GBM_VULKAN_COMPRESSION_* requested while allocating, and applied
+	// once allocated
+	uint32_t compression;
+	// Scanned out by the PRIME display device
+	bool prime;
+	// Backed by system memory rather than VRAM
+	bool system_memory;
+	// References from the caller and from views of the BO
+	atomic_int refs;
+	// Identifies the BO in trace events
+	uint64_t id;
+	// For views, the BO whose memory, dumb buffer or imported dma-bufs they
+	// share, NULL otherwise
+	struct gbm_vulkan_bo *parent;
 };
 
 static inline struct gbm_vulkan_bo *gbm_vulkan_bo(struct gbm_bo *bo) {
         return (struct gbm_vulkan_bo *) bo;
 }
 
-static void gbm_vulkan_bo_destroy(struct gbm_bo *_bo) {
-	struct gbm_vulkan_device *vulkan = gbm_vulkan_device(_bo->gbm);
-	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+// Ends the event of an operation that returned bo, NULL if it failed
+static void vulkan_trace_end_bo(struct gbm_bo *_bo) {
+	if (!vulkan_trace_enabled()) {
+		return;
+	}
+	if (_bo == NULL) {
+		vulkan_trace_write('I', "failed");
+	} else {
+		struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+		vulkan_trace_write('I', "bo=%"PRIu64" modifier=0x%016"PRIX64" size=%"PRIu64,
+			bo->id, bo->modifier, (uint64_t)bo->mem_size);
+	}
+	vulkan_trace_write_end();
+}
 
-	if (bo->memory) {
-		vkFreeMemory(vulkan->device, bo->memory, NULL);
+static void vulkan_stats_count(atomic_uint_least64_t *counter) {
+	atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+static void vulkan_stats_raise_peak(atomic_uint_least64_t *peak, uint64_t value) {
+	uint64_t old = atomic_load_explicit(peak, memory_order_relaxed);
+	while (old < value && !atomic_compare_exchange_weak_explicit(peak, &old, value,
+			memory_order_relaxed, memory_order_relaxed)) {
 	}
-	if (bo->image) {
-		vkDestroyImage(vulkan->device, bo->image, NULL);
+}
+
+static void vulkan_stats_add_live_bo(struct gbm_vulkan_device *dev) {
+	struct vulkan_stats *stats = &dev->stats;
+	uint64_t live = atomic_fetch_add_explicit(&stats->live_bos, 1, memory_order_relaxed) + 1;
+	vulkan_stats_raise_peak(&stats->peak_live_bos, live);
+}
+
+// Accounts for BO memory of the given type being allocated or freed
+static void vulkan_stats_add_memory(struct gbm_vulkan_device *dev, uint32_t mem_type,
+		VkDeviceSize size) {
+	struct vulkan_stats *stats = &dev->stats;
+	uint32_t heap = dev->mem_props.memoryTypes[mem_type].heapIndex;
+	atomic_fetch_add_explicit(&stats->memory_type_bytes[mem_type], size, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stats->memory_heap_bytes[heap], size, memory_order_relaxed);
+	uint64_t total = atomic_fetch_add_explicit(&stats->memory_bytes, size,
+		memory_order_relaxed) + size;
+	vulkan_stats_raise_peak(&stats->peak_memory_bytes, total);
+}
+
+static void vulkan_stats_sub_memory(struct gbm_vulkan_device *dev, uint32_t mem_type,
+		VkDeviceSize size) {
+	struct vulkan_stats *stats = &dev->stats;
+	uint32_t heap = dev->mem_props.memoryTypes[mem_type].heapIndex;
+	atomic_fetch_sub_explicit(&stats->memory_type_bytes[mem_type], size, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&stats->memory_heap_bytes[heap], size, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&stats->memory_bytes, size, memory_order_relaxed);
+}
+
+void gbm_vulkan_device_get_stats(struct gbm_device *gbm, struct gbm_vulkan_stats *out) {
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(gbm);
+	struct vulkan_stats *stats = &dev->stats;
+	*out = (struct gbm_vulkan_stats){
+		.live_bos = atomic_load_explicit(&stats->live_bos, memory_order_relaxed),
+		.peak_live_bos = atomic_load_explicit(&stats->peak_live_bos, memory_order_relaxed),
+		.memory_bytes = atomic_load_explicit(&stats->memory_bytes, memory_order_relaxed),
+		.peak_memory_bytes = atomic_load_explicit(&stats->peak_memory_bytes, memory_order_relaxed),
+		.memory_type_count = dev->mem_props.memoryTypeCount,
+		.memory_heap_count = dev->mem_props.memoryHeapCount,
+		.creates = atomic_load_explicit(&stats->creates, memory_order_relaxed),
+		.imports = atomic_load_explicit(&stats->imports, memory_order_relaxed),
+		.exports = atomic_load_explicit(&stats->exports, memory_order_relaxed),
+		.maps = atomic_load_explicit(&stats->maps, memory_order_relaxed),
+		.warm_pool_hits = atomic_load_explicit(&stats->warm_pool_hits, memory_order_relaxed),
+		.warm_pool_misses = atomic_load_explicit(&stats->warm_pool_misses, memory_order_relaxed),
+		.memory_cache_hits = atomic_load_explicit(&stats->memory_cache_hits, memory_order_relaxed),
+		.memory_cache_misses = atomic_load_explicit(&stats->memory_cache_misses, memory_order_relaxed),
+	};
+	for (uint32_t idx = 0; idx < GBM_VULKAN_STATS_MAX_MEMORY_TYPES; idx++) {
+		out->memory_type_bytes[idx] = atomic_load_explicit(&stats->memory_type_bytes[idx],
+			memory_order_relaxed);
 	}
-	if (bo->import) {
-		free(bo->import);
+	for (uint32_t idx = 0; idx < GBM_VULKAN_STATS_MAX_MEMORY_HEAPS; idx++) {
+		out->memory_heap_bytes[idx] = atomic_load_explicit(&stats->memory_heap_bytes[idx],
+			memory_order_relaxed);
 	}
-	if (bo->mapping) {
-		if (bo->mapping->refcnt > 0) {
-			fprintf(stderr, "!!! BO destroyed with active mapping\n");
+	for (uint32_t op = 0; op < GBM_VULKAN_STATS_OP_COUNT; op++) {
+		for (uint32_t bucket = 0; bucket < GBM_VULKAN_STATS_LATENCY_BUCKETS; bucket++) {
+			out->latency[op][bucket] = atomic_load_explicit(&stats->latency[op][bucket],
+				memory_order_relaxed);
 		}
-		free(bo->mapping);
 	}
-	free(bo);
 }
 
-static struct gbm_bo * gbm_vulkan_bo_create(struct gbm_device *gbm,
-		uint32_t width, uint32_t height, uint32_t format, uint32_t usage,
-		const uint64_t *modifiers, const unsigned int count) {
-	struct gbm_vulkan_device *vulkan = gbm_vulkan_device(gbm);
+static void vulkan_stats_dump(struct gbm_vulkan_device *dev) {
+	static const char *const op_names[GBM_VULKAN_STATS_OP_COUNT] = {
+		[GBM_VULKAN_STATS_OP_CREATE] = "create",
+		[GBM_VULKAN_STATS_OP_IMPORT] = "import",
+		[GBM_VULKAN_STATS_OP_MAP] = "map",
+		[GBM_VULKAN_STATS_OP_GET_FD] = "get_fd",
+	};
+	struct gbm_vulkan_stats stats;
+	gbm_vulkan_device_get_stats(&dev->base, &stats);
+
+	fprintf(stderr, "GBM Vulkan stats: %"PRIu64" BOs (peak %"PRIu64"), "
+		"%"PRIu64" bytes of memory (peak %"PRIu64")\n",
+		stats.live_bos, stats.peak_live_bos, stats.memory_bytes, stats.peak_memory_bytes);
+	for (uint32_t idx = 0; idx < stats.memory_heap_count; idx++) {
+		if (stats.memory_heap_bytes[idx] > 0) {
+			fprintf(stderr, "  heap %"PRIu32": %"PRIu64" bytes\n", idx, stats.memory_heap_bytes[idx]);
+		}
+	}
+	for (uint32_t idx = 0; idx < stats.memory_type_count; idx++) {
+		if (stats.memory_type_bytes[idx] > 0) {
+			fprintf(stderr, "  memory type %"PRIu32": %"PRIu64" bytes\n", idx,
+				stats.memory_type_bytes[idx]);
+		}
+	}
+	fprintf(stderr, "  %"PRIu64" creates, %"PRIu64" imports, %"PRIu64" exports, %"PRIu64" maps\n",
+		stats.creates, stats.imports, stats.exports, stats.maps);
+	fprintf(stderr, "  warm pool: %"PRIu64" hits, %"PRIu64" misses; "
+		"memory cache: %"PRIu64" hits, %"PRIu64" misses\n",
+		stats.warm_pool_hits, stats.warm_pool_misses,
+		stats.memory_cache_hits, stats.memory_cache_misses);
+	for (uint32_t op = 0; op < GBM_VULKAN_STATS_OP_COUNT; op++) {
+		fprintf(stderr, "  %s latency:", op_names[op]);
+		for (uint32_t bucket = 0; bucket < GBM_VULKAN_STATS_LATENCY_BUCKETS; bucket++) {
+			if (stats.latency[op][bucket] == 0) {
+				continue;
+			}
+			if (bucket == GBM_VULKAN_STATS_LATENCY_BUCKETS - 1) {
+				fprintf(stderr, " >=%"PRIu64"us: %"PRIu64, UINT64_C(1) << (bucket - 1),
+					stats.latency[op][bucket]);
+			} else {
+				fprintf(stderr, " <%"PRIu64"us: %"PRIu64, UINT64_C(1) << bucket,
+					stats.latency[op][bucket]);
+			}
+		}
+		fprintf(stderr, "\n");
+	}
+}
 
-	format = core->v0.format_canonicalize(format);
+// Records the latency of an operation that started at start_ns, and prints
+// the stats when the dump interval has passed
+static void vulkan_stats_record(struct gbm_vulkan_device *dev, uint32_t op, uint64_t start_ns) {
+	struct vulkan_stats *stats = &dev->stats;
+	uint64_t now = get_time_ns();
+	uint64_t us = (now - start_ns) / 1000;
+	uint32_t bucket = 0;
+	while (us > 0 && bucket < GBM_VULKAN_STATS_LATENCY_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	vulkan_stats_count(&stats->latency[op][bucket]);
 
-	if (usage & (GBM_BO_USE_PROTECTED | GBM_BO_USE_WRITE)) {
-		// TODO: Dumb buffer fallback?
-		fprintf(stderr, "Cannot create dumb buffer\n");
-		return NULL;
+	if (stats->dump_interval_ns == 0) {
+		return;
 	}
+	uint64_t next = atomic_load_explicit(&stats->next_dump_ns, memory_order_relaxed);
+	// Only the thread that moves the deadline prints
+	if (now >= next && atomic_compare_exchange_strong_explicit(&stats->next_dump_ns, &next,
+			now + stats->dump_interval_ns, memory_order_relaxed, memory_order_relaxed)) {
+		vulkan_stats_dump(dev);
+	}
+}
 
+static struct gbm_vulkan_bo *gbm_vulkan_bo_alloc(struct gbm_device *gbm,
+		uint32_t width, uint32_t height, uint32_t format) {
 	struct gbm_vulkan_bo *bo = calloc(1, sizeof *bo);
 	if (bo == NULL) {
 		return NULL;
@@ -504,271 +1219,2986 @@ static struct gbm_bo * gbm_vulkan_bo_create(struct gbm_device *gbm,
 	bo->base.v0.width = width;
 	bo->base.v0.height = height;
 	bo->base.v0.format = format;
+	bo->export_fd = -1;
+	bo->refs = 1;
+	bo->id = atomic_fetch_add_explicit(&gbm_vulkan_device(gbm)->next_bo_id, 1,
+		memory_order_relaxed) + 1;
+	vulkan_stats_add_live_bo(gbm_vulkan_device(gbm));
+	return bo;
+}
 
-	const struct vulkan_format_props *format_props =
-		vulkan_format_props_from_drm(vulkan, format);
-	if (!format_props) {
-		fprintf(stderr, "no matching drm format 0x%08x available\n", format);
-		gbm_vulkan_bo_destroy(&bo->base);
-		return NULL;
+static bool vulkan_copy_wait(struct gbm_vulkan_device *dev, uint64_t point) {
+	if (point == 0) {
+		return true;
+	}
+	VkSemaphoreWaitInfo wait_info = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+		.semaphoreCount = 1,
+		.pSemaphores = &dev->copy.timeline,
+		.pValues = &point,
+	};
+	if (dev->api.vkWaitSemaphoresKHR(dev->device, &wait_info, UINT64_MAX) != VK_SUCCESS) {
+		fprintf(stderr, "Waiting for copy failed\n");
+		errno = EIO;
+		return false;
 	}
+	return true;
+}
 
-	int filtered_mods_count = 0;
-	uint64_t filtered_mods[count];
-	for (unsigned int idx = 0; idx < count; idx++) {
-		const struct vulkan_format_modifier_props *mod_props =
-			vulkan_format_props_find_modifier(format_props, modifiers[idx], usage & GBM_BO_USE_RENDERING);
-		if (mod_props == NULL) {
-			continue;
+static void vulkan_memory_cache_remove_locked(struct gbm_vulkan_device *dev, uint32_t idx) {
+	struct vulkan_memory_cache *cache = &dev->memory_cache;
+	cache->entries[idx] = cache->entries[--cache->count];
+}
+
+static void vulkan_memory_cache_expire_locked(struct gbm_vulkan_device *dev, uint64_t now) {
+	struct vulkan_memory_cache *cache = &dev->memory_cache;
+	for (uint32_t idx = 0; idx < cache->count;) {
+		if (now - cache->entries[idx].released_ns > VULKAN_MEMORY_CACHE_MAX_AGE_NS) {
+			vkFreeMemory(dev->device, cache->entries[idx].memory, NULL);
+			vulkan_stats_sub_memory(dev, cache->entries[idx].mem_type, cache->entries[idx].size);
+			vulkan_memory_cache_remove_locked(dev, idx);
+		} else {
+			idx++;
 		}
+	}
+}
 
-		// Why does vkImageCreateInfo not filter this when picking a modifier?!
-		if (mod_props->max_extent.width < width ||
-				mod_props->max_extent.height < height) {
+static void *vulkan_memory_cache_run(void *data) {
+	struct gbm_vulkan_device *dev = data;
+	struct vulkan_memory_cache *cache = &dev->memory_cache;
+	pthread_mutex_lock(&cache->lock);
+	while (!cache->stopping) {
+		vulkan_memory_cache_expire_locked(dev, get_time_ns());
+		if (cache->count == 0) {
+			pthread_cond_wait(&cache->cond, &cache->lock);
 			continue;
 		}
-		filtered_mods[filtered_mods_count++] = mod_props->props.drmFormatModifier;
+		uint64_t oldest = cache->entries[0].released_ns;
+		for (uint32_t idx = 1; idx < cache->count; idx++) {
+			if (cache->entries[idx].released_ns < oldest) {
+				oldest = cache->entries[idx].released_ns;
+			}
+		}
+		uint64_t deadline = oldest + VULKAN_MEMORY_CACHE_MAX_AGE_NS + 1;
+		struct timespec ts = {
+			.tv_sec = deadline / 1000000000,
+			.tv_nsec = deadline % 1000000000,
+		};
+		pthread_cond_timedwait(&cache->cond, &cache->lock, &ts);
 	}
+	pthread_mutex_unlock(&cache->lock);
+	return NULL;
+}
 
+// Keeps the memory of a BO that is being destroyed for reuse. Returns false
+// if the memory is not eligible and has to be freed by the caller.
+static bool vulkan_memory_cache_put(struct gbm_vulkan_device *dev, const struct gbm_vulkan_bo *bo) {
+	if (bo->dumb || bo->import || bo->export_fd >= 0 ||
+			atomic_load(&bo->mapping.refcnt) > 0) {
+		return false;
+	}
 
-	VkImageDrmFormatModifierListCreateInfoEXT drm_format_mod = {
-		.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_LIST_CREATE_INFO_EXT,
-		.drmFormatModifierCount = filtered_mods_count,
-		.pDrmFormatModifiers = filtered_mods,
-	};
-	VkExternalMemoryImageCreateInfo ext_mem = {
-		.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
-		.pNext = &drm_format_mod,
-		.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
-	};
-	VkImageCreateInfo img_create = {
-		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-		.pNext = &ext_mem,
-		.imageType = VK_IMAGE_TYPE_2D,
-		.extent = { .width = width, .height = height, .depth = 1 },
-		.mipLevels = 1,
-		.arrayLayers = 1,
-		.format = format_props->format.vk,
-		.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT,
-		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-		.usage = VK_IMAGE_USAGE_SAMPLED_BIT,
-		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-		.samples = VK_SAMPLE_COUNT_1_BIT,
+	struct vulkan_memory_cache *cache = &dev->memory_cache;
+	uint64_t now = get_time_ns();
+	pthread_mutex_lock(&cache->lock);
+	vulkan_memory_cache_expire_locked(dev, now);
+	if (cache->count == VULKAN_MEMORY_CACHE_SIZE) {
+		uint32_t oldest = 0;
+		for (uint32_t idx = 1; idx < cache->count; idx++) {
+			if (cache->entries[idx].released_ns < cache->entries[oldest].released_ns) {
+				oldest = idx;
+			}
+		}
+		vkFreeMemory(dev->device, cache->entries[oldest].memory, NULL);
+		vulkan_stats_sub_memory(dev, cache->entries[oldest].mem_type, cache->entries[oldest].size);
+		vulkan_memory_cache_remove_locked(dev, oldest);
+	}
+	cache->entries[cache->count++] = (struct vulkan_cached_memory){
+		.memory = bo->memory,
+		.size = bo->mem_size,
+		.mem_type = bo->mem_type,
+		.modifier = bo->modifier,
+		.released_ns = now,
 	};
+	if (!cache->started) {
+		// Without the thread, entries still expire on the next put or take
+		int err = pthread_create(&cache->thread, NULL, vulkan_memory_cache_run, dev);
+		if (err != 0) {
+			fprintf(stderr, "Could not start memory cache thread: %s\n", strerror(err));
+		}
+		cache->started = err == 0;
+	}
+	pthread_cond_signal(&cache->cond);
+	pthread_mutex_unlock(&cache->lock);
+	return true;
+}
 
-	if (vkCreateImage(vulkan->device, &img_create, NULL, &bo->image) != VK_SUCCESS) {
-		gbm_vulkan_bo_destroy(&bo->base);
-		return NULL;
+// Takes the smallest cached allocation that fits an image, as long as it
+// would not waste more than half of it
+static VkDeviceMemory vulkan_memory_cache_take(struct gbm_vulkan_device *dev,
+		uint32_t mem_type, uint64_t modifier, VkDeviceSize size, VkDeviceSize *mem_size) {
+	struct vulkan_memory_cache *cache = &dev->memory_cache;
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	pthread_mutex_lock(&cache->lock);
+	vulkan_memory_cache_expire_locked(dev, get_time_ns());
+	int best = -1;
+	for (uint32_t idx = 0; idx < cache->count; idx++) {
+		const struct vulkan_cached_memory *entry = &cache->entries[idx];
+		if (entry->mem_type == mem_type && entry->modifier == modifier &&
+				entry->size >= size && entry->size / 2 <= size &&
+				(best == -1 || entry->size < cache->entries[best].size)) {
+			best = idx;
+		}
+	}
+	if (best != -1) {
+		memory = cache->entries[best].memory;
+		*mem_size = cache->entries[best].size;
+		vulkan_memory_cache_remove_locked(dev, best);
 	}
+	pthread_mutex_unlock(&cache->lock);
+	vulkan_stats_count(memory != VK_NULL_HANDLE ?
+		&dev->stats.memory_cache_hits : &dev->stats.memory_cache_misses);
+	return memory;
+}
 
-	VkMemoryRequirements mem_reqs = {0};
-	vkGetImageMemoryRequirements(vulkan->device, bo->image, &mem_reqs);
+static void vulkan_memory_cache_finish(struct gbm_vulkan_device *dev) {
+	struct vulkan_memory_cache *cache = &dev->memory_cache;
+	if (cache->started) {
+		pthread_mutex_lock(&cache->lock);
+		cache->stopping = true;
+		pthread_cond_signal(&cache->cond);
+		pthread_mutex_unlock(&cache->lock);
+		pthread_join(cache->thread, NULL);
+		cache->started = false;
+	}
+	for (uint32_t idx = 0; idx < cache->count; idx++) {
+		vkFreeMemory(dev->device, cache->entries[idx].memory, NULL);
+		vulkan_stats_sub_memory(dev, cache->entries[idx].mem_type, cache->entries[idx].size);
+	}
+	cache->count = 0;
+	pthread_cond_destroy(&cache->cond);
+	pthread_mutex_destroy(&cache->lock);
+}
 
-	int mem_type_index = vulkan_find_mem_type(vulkan->physical_device,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mem_reqs.memoryTypeBits);
-	if (mem_type_index == -1) {
-		gbm_vulkan_bo_destroy(&bo->base);
-		return NULL;
+// Drops a reference, returning whether it was the last one
+static bool gbm_vulkan_bo_unref(struct gbm_vulkan_bo *bo) {
+	return atomic_fetch_sub(&bo->refs, 1) == 1;
+}
+
+static void gbm_vulkan_bo_destroy(struct gbm_bo *_bo) {
+	struct gbm_vulkan_device *vulkan = gbm_vulkan_device(_bo->gbm);
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+	uint64_t id = bo->id;
+	vulkan_trace_begin("bo_destroy bo=%"PRIu64, id);
+
+	if (bo->transfer) {
+		// Asynchronous readbacks may still be copying from it
+		vulkan_copy_wait(vulkan, bo->transfer->point);
+		vkDestroyImage(vulkan->device, bo->transfer->image, NULL);
+		if (bo->transfer->memory) {
+			vkFreeMemory(vulkan->device, bo->transfer->memory, NULL);
+		}
+		free(bo->transfer);
+	}
+	if (bo->image) {
+		vkDestroyImage(vulkan->device, bo->image, NULL);
 	}
+	if (bo->memory && !bo->parent && !vulkan_memory_cache_put(vulkan, bo)) {
+		vkFreeMemory(vulkan->device, bo->memory, NULL);
+		vulkan_stats_sub_memory(vulkan, bo->mem_type, bo->mem_size);
+	}
+	if (bo->export_fd >= 0) {
+		close(bo->export_fd);
+	}
+	if (bo->import) {
+		if (bo->import->owned) {
+			for (size_t idx = 0; idx < bo->plane_cnt; idx++) {
+				close(bo->import->fds[idx]);
+			}
+		}
+		free(bo->import);
+	}
+	if (bo->dumb && !bo->parent) {
+		if (bo->dumb->map) {
+			munmap(bo->dumb->map, bo->dumb->size);
+		}
+		struct drm_mode_destroy_dumb destroy = {
+			.handle = bo->dumb->handle,
+		};
+		drmIoctl(vulkan->base.v0.fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+		free(bo->dumb);
+	}
+	if (bo->cpu_map) {
+		munmap(bo->cpu_map, bo->cpu_map_size);
+	}
+	if (atomic_load(&bo->mapping.refcnt) > 0) {
+		fprintf(stderr, "!!! BO destroyed with active mapping\n");
+	}
+	struct gbm_vulkan_bo *parent = bo->parent;
+	free(bo);
+	atomic_fetch_sub_explicit(&vulkan->stats.live_bos, 1, memory_order_relaxed);
+	vulkan_trace_end("bo=%"PRIu64, id);
+	if (parent != NULL && gbm_vulkan_bo_unref(parent)) {
+		gbm_vulkan_bo_destroy(&parent->base);
+	}
+}
 
-	VkExportMemoryAllocateInfo export_mem = {
-		.sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO,
-		.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
-	};
-	VkMemoryAllocateInfo mem_alloc = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-		.pNext = &export_mem,
-		.allocationSize = mem_reqs.size,
-		.memoryTypeIndex = mem_type_index,
-	};
+static void *vulkan_reclaimer_run(void *data) {
+	struct vulkan_reclaimer *reclaimer = data;
+	pthread_mutex_lock(&reclaimer->lock);
+	for (;;) {
+		while (reclaimer->count == 0 && !reclaimer->stopping) {
+			pthread_cond_wait(&reclaimer->not_empty, &reclaimer->lock);
+		}
+		// Only stop once the queue is drained
+		if (reclaimer->count == 0) {
+			break;
+		}
+		struct gbm_vulkan_bo *bo = reclaimer->queue[reclaimer->head];
+		reclaimer->head = (reclaimer->head + 1) % VULKAN_RECLAIM_QUEUE_DEPTH;
+		reclaimer->count--;
+		pthread_cond_signal(&reclaimer->not_full);
 
-	if (vkAllocateMemory(vulkan->device, &mem_alloc, NULL, &bo->memory) != VK_SUCCESS) {
+		pthread_mutex_unlock(&reclaimer->lock);
 		gbm_vulkan_bo_destroy(&bo->base);
-		return NULL;
+		pthread_mutex_lock(&reclaimer->lock);
 	}
+	pthread_mutex_unlock(&reclaimer->lock);
+	return NULL;
+}
 
+static void vulkan_reclaimer_start(struct gbm_vulkan_device *dev) {
+	struct vulkan_reclaimer *reclaimer = &dev->reclaimer;
+	pthread_mutex_init(&reclaimer->lock, NULL);
+	pthread_cond_init(&reclaimer->not_empty, NULL);
+	pthread_cond_init(&reclaimer->not_full, NULL);
+	int err = pthread_create(&reclaimer->thread, NULL, vulkan_reclaimer_run, reclaimer);
+	if (err != 0) {
+		fprintf(stderr, "Could not start reclaimer thread: %s\n", strerror(err));
+		pthread_cond_destroy(&reclaimer->not_full);
+		pthread_cond_destroy(&reclaimer->not_empty);
+		pthread_mutex_destroy(&reclaimer->lock);
+		return;
+	}
+	reclaimer->enabled = true;
+}
+
+// Destroys everything that is still queued and stops the thread
+static void vulkan_reclaimer_finish(struct gbm_vulkan_device *dev) {
+	struct vulkan_reclaimer *reclaimer = &dev->reclaimer;
+	pthread_mutex_lock(&reclaimer->lock);
+	reclaimer->stopping = true;
+	pthread_cond_signal(&reclaimer->not_empty);
+	pthread_mutex_unlock(&reclaimer->lock);
+	pthread_join(reclaimer->thread, NULL);
+
+	pthread_cond_destroy(&reclaimer->not_full);
+	pthread_cond_destroy(&reclaimer->not_empty);
+	pthread_mutex_destroy(&reclaimer->lock);
+	reclaimer->enabled = false;
+}
+
+// Drops the caller's reference to a BO and destroys it if that was the last,
+// on the reclaimer thread if there is one
+static void gbm_vulkan_bo_reclaim(struct gbm_bo *_bo) {
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
+	struct vulkan_reclaimer *reclaimer = &dev->reclaimer;
+	// Views may still share its memory
+	if (!gbm_vulkan_bo_unref(gbm_vulkan_bo(_bo))) {
+		return;
+	}
+	if (!reclaimer->enabled) {
+		gbm_vulkan_bo_destroy(_bo);
+		return;
+	}
+
+	pthread_mutex_lock(&reclaimer->lock);
+	while (reclaimer->count == VULKAN_RECLAIM_QUEUE_DEPTH) {
+		pthread_cond_wait(&reclaimer->not_full, &reclaimer->lock);
+	}
+	uint32_t tail = (reclaimer->head + reclaimer->count) % VULKAN_RECLAIM_QUEUE_DEPTH;
+	reclaimer->queue[tail] = gbm_vulkan_bo(_bo);
+	reclaimer->count++;
+	pthread_cond_signal(&reclaimer->not_empty);
+	pthread_mutex_unlock(&reclaimer->lock);
+}
+
+static bool gbm_vulkan_dumb_format_supported(const struct gbm_vulkan_device *vulkan,
+		uint32_t format) {
+	if (!vulkan->has_dumb) {
+		return false;
+	}
+	const struct pixel_format_info *info = drm_get_pixel_format_info(format);
+	return info != NULL && info->block_width <= 1 && info->block_height <= 1;
+}
+
+// CPU-written buffers skip Vulkan entirely and use a persistently mapped
+// dumb buffer on the KMS fd, shared with others through PRIME.
+static bool gbm_vulkan_bo_create_dumb(struct gbm_vulkan_device *vulkan, struct gbm_vulkan_bo *bo) {
+	int fd = vulkan->base.v0.fd;
+	const struct pixel_format_info *info = drm_get_pixel_format_info(bo->base.v0.format);
+	assert(info != NULL);
+
+	bo->dumb = calloc(1, sizeof(*bo->dumb));
+	if (bo->dumb == NULL) {
+		return false;
+	}
+
+	struct drm_mode_create_dumb create = {
+		.width = bo->base.v0.width,
+		.height = bo->base.v0.height,
+		.bpp = info->bytes_per_block * 8,
+	};
+	if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) != 0) {
+		fprintf(stderr, "Could not create dumb buffer: %s\n", strerror(errno));
+		free(bo->dumb);
+		bo->dumb = NULL;
+		return false;
+	}
+	bo->dumb->handle = create.handle;
+	bo->dumb->size = create.size;
+
+	struct drm_mode_map_dumb map = {
+		.handle = create.handle,
+	};
+	if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map) != 0) {
+		fprintf(stderr, "Could not map dumb buffer: %s\n", strerror(errno));
+		return false;
+	}
+	void *addr = mmap(NULL, create.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, map.offset);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "Could not mmap dumb buffer: %s\n", strerror(errno));
+		return false;
+	}
+	bo->dumb->map = addr;
+
+	bo->plane_cnt = 1;
+	bo->modifier = DRM_FORMAT_MOD_LINEAR;
+	bo->strides[0] = create.pitch;
+	bo->offsets[0] = 0;
+	return true;
+}
+
+static VkImageUsageFlags vulkan_modifier_transfer_usage(
+		const struct vulkan_format_modifier_props *mod_props) {
+	VkImageUsageFlags usage = 0;
+	if (mod_props->props.drmFormatModifierTilingFeatures & VK_FORMAT_FEATURE_TRANSFER_SRC_BIT) {
+		usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	}
+	if (mod_props->props.drmFormatModifierTilingFeatures & VK_FORMAT_FEATURE_TRANSFER_DST_BIT) {
+		usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	}
+	return usage;
+}
+
+static bool vulkan_modifier_fits(const struct vulkan_format_modifier_props *mod_props,
+		uint32_t width, uint32_t height) {
+	// Why does vkImageCreateInfo not filter this when picking a modifier?!
+	return mod_props->max_extent.width >= width && mod_props->max_extent.height >= height;
+}
+
+static bool vulkan_modifier_allowed(const struct gbm_vulkan_device *vulkan,
+		const struct vulkan_format_modifier_props *mod_props, uint32_t usage) {
+	if ((usage & (GBM_BO_USE_LINEAR | GBM_BO_USE_CURSOR)) &&
+			mod_props->props.drmFormatModifier != DRM_FORMAT_MOD_LINEAR) {
+		return false;
+	}
+	if (!(usage & GBM_BO_USE_SCANOUT)) {
+		return true;
+	}
+	// With a PRIME display device, its planes rather than ours scan out.
+	// Any display engine takes linear buffers, other layouts only if a
+	// plane lists them.
+	if (vulkan->prime_display) {
+		return vulkan->has_prime_scanout_info ? mod_props->prime :
+			mod_props->props.drmFormatModifier == DRM_FORMAT_MOD_LINEAR;
+	}
+	return !vulkan->has_scanout_info || mod_props->scanout;
+}
+
+static size_t vulkan_filter_modifiers(const struct gbm_vulkan_device *vulkan,
+		const struct vulkan_format_props *format_props, uint32_t width, uint32_t height,
+		uint32_t usage, const uint64_t *modifiers, unsigned int count,
+		struct vulkan_modifier_candidate *out) {
+	size_t out_count = 0;
+	for (unsigned int idx = 0; idx < count; idx++) {
+		const struct vulkan_format_modifier_props *mod_props =
+			vulkan_format_props_find_modifier(format_props, modifiers[idx], usage & GBM_BO_USE_RENDERING);
+		if (mod_props == NULL || !vulkan_modifier_fits(mod_props, width, height) ||
+				!vulkan_modifier_allowed(vulkan, mod_props, usage)) {
+			continue;
+		}
+		out[out_count++] = (struct vulkan_modifier_candidate){
+			.props = mod_props,
+			.tier = vulkan_modifier_tier(vulkan, mod_props, usage),
+		};
+	}
+	return out_count;
+}
+
+// Without a modifier list from the caller, the usage is all we have to go
+// by. Linear and cursor buffers are forced linear, scanout buffers stick to
+// layouts that the KMS planes (or failing that, our heuristics) consider
+// safe to scan out, and everything else gets the device's ranked list of
+// all supported modifiers.
+static size_t vulkan_select_implicit_modifiers(const struct gbm_vulkan_device *vulkan,
+		const struct vulkan_format_props *format_props, uint32_t width, uint32_t height,
+		uint32_t usage, struct vulkan_modifier_candidate *out) {
+	bool render = usage & GBM_BO_USE_RENDERING;
+	const struct vulkan_format_modifier_props *supported =
+		render ? format_props->render_mods : format_props->texture_mods;
+	uint32_t supported_count =
+		render ? format_props->render_mod_count : format_props->texture_mod_count;
+
+	size_t out_count = 0;
+	size_t safe_count = 0;
+	for (uint32_t idx = 0; idx < supported_count; idx++) {
+		const struct vulkan_format_modifier_props *mod_props = &supported[idx];
+		if (!vulkan_modifier_fits(mod_props, width, height) ||
+				!vulkan_modifier_allowed(vulkan, mod_props, usage)) {
+			continue;
+		}
+		out[out_count++] = (struct vulkan_modifier_candidate){
+			.props = mod_props,
+			.tier = vulkan_modifier_tier(vulkan, mod_props, usage),
+		};
+		if (mod_props->mod_class != VULKAN_MODIFIER_COMPRESSED) {
+			safe_count++;
+		}
+	}
+
+	// Compressed layouts need the display engine to understand the
+	// metadata planes, which we cannot know without plane information.
+	// Only fall back to them if nothing else is left.
+	if ((usage & GBM_BO_USE_SCANOUT) && !vulkan->has_scanout_info &&
+			safe_count > 0 && safe_count < out_count) {
+		size_t kept = 0;
+		for (size_t idx = 0; idx < out_count; idx++) {
+			if (out[idx].props->mod_class != VULKAN_MODIFIER_COMPRESSED) {
+				out[kept++] = out[idx];
+			}
+		}
+		out_count = kept;
+	}
+	return out_count;
+}
+
+static bool vulkan_usage_supported(const struct gbm_vulkan_device *vulkan,
+		const struct vulkan_format_props *format_props, uint32_t usage) {
+	if (usage & GBM_BO_USE_PROTECTED) {
+		// Not implemented
+		return false;
+	}
+	if (usage & GBM_BO_USE_WRITE) {
+		return gbm_vulkan_dumb_format_supported(vulkan, format_props->format.drm);
+	}
+
+	bool render = usage & GBM_BO_USE_RENDERING;
+	const struct vulkan_format_modifier_props *mods =
+		render ? format_props->render_mods : format_props->texture_mods;
+	uint32_t mod_count =
+		render ? format_props->render_mod_count : format_props->texture_mod_count;
+	for (uint32_t idx = 0; idx < mod_count; idx++) {
+		if (vulkan_modifier_allowed(vulkan, &mods[idx], usage)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Must run after everything that affects vulkan_modifier_allowed is known
+static void vulkan_format_props_compute_usage(const struct gbm_vulkan_device *vulkan,
+		struct vulkan_format_props *format_props) {
+	format_props->supported_usage = 0;
+	for (uint32_t usage = 0; usage <= VULKAN_USAGE_MASK; usage++) {
+		if ((usage & VULKAN_USAGE_MASK) == usage &&
+				vulkan_usage_supported(vulkan, format_props, usage)) {
+			format_props->supported_usage |= vulkan_usage_bit(usage);
+		}
+	}
+}
+
+static VkImageCreateInfo vulkan_bo_image_info(const struct gbm_vulkan_bo *bo,
+		const struct vulkan_format_props *format_props, const void *next) {
+	return (VkImageCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+		.pNext = next,
+		.imageType = VK_IMAGE_TYPE_2D,
+		.extent = { .width = bo->base.v0.width, .height = bo->base.v0.height, .depth = 1 },
+		.mipLevels = 1,
+		.arrayLayers = 1,
+		.format = format_props->format.vk,
+		.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT,
+		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+		.usage = VK_IMAGE_USAGE_SAMPLED_BIT,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+	};
+}
+
+static bool gbm_vulkan_dma_heap_wanted(const struct gbm_vulkan_device *vulkan, uint32_t usage) {
+	if (vulkan->dma_heap_fd < 0) {
+		return false;
+	}
+	if (vulkan->prime_display && (usage & GBM_BO_USE_SCANOUT)) {
+		return true;
+	}
+	if (usage & vulkan->dma_heap_usage) {
+		return true;
+	}
+	return vulkan->dma_heap_sampled && !(usage & GBM_BO_USE_RENDERING);
+}
+
+// Asks the driver for the pitch it would give a linear image of the BO, by
+// creating one from the modifier list and reading back its layout. Returns 0
+// if the driver has no such image.
+static uint64_t vulkan_bo_linear_pitch(struct gbm_vulkan_device *vulkan, const struct gbm_vulkan_bo *bo,
+		const struct vulkan_format_props *format_props) {
+	const uint64_t linear = DRM_FORMAT_MOD_LINEAR;
+	VkImageDrmFormatModifierListCreateInfoEXT mod_list = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_LIST_CREATE_INFO_EXT,
+		.drmFormatModifierCount = 1,
+		.pDrmFormatModifiers = &linear,
+	};
+	VkExternalMemoryImageCreateInfo ext_mem = {
+		.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
+		.pNext = &mod_list,
+		.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+	};
+	VkImageCreateInfo img_create = vulkan_bo_image_info(bo, format_props, &ext_mem);
+	VkImage image;
+	if (vkCreateImage(vulkan->device, &img_create, NULL, &image) != VK_SUCCESS) {
+		return 0;
+	}
+	const VkImageSubresource img_subres = {
+		.aspectMask = VK_IMAGE_ASPECT_MEMORY_PLANE_0_BIT_EXT,
+	};
+	VkSubresourceLayout subres_layout = {0};
+	vkGetImageSubresourceLayout(vulkan->device, image, &img_subres, &subres_layout);
+	vkDestroyImage(vulkan->device, image, NULL);
+	return subres_layout.rowPitch;
+}
+
+// Allocates a linear BO from the DMA-BUF heap and imports it into Vulkan,
+// leaving the driver with nothing to do but map memory it did not allocate.
+// Returns false to leave the BO to the Vulkan allocator.
+static bool gbm_vulkan_bo_create_dma_heap(struct gbm_vulkan_device *vulkan, struct gbm_vulkan_bo *bo,
+		const struct vulkan_format_props *format_props) {
+	const struct pixel_format_info *info = drm_get_pixel_format_info(bo->base.v0.format);
+	if (info == NULL || info->block_width > 1 || info->block_height > 1) {
+		return false;
+	}
+
+	// Use the pitch the driver would pick itself, so it accepts the layout
+	uint64_t stride = vulkan_bo_linear_pitch(vulkan, bo, format_props);
+	if (stride < (uint64_t)bo->base.v0.width * info->bytes_per_block) {
+		return false;
+	}
+	uint64_t page_size = sysconf(_SC_PAGESIZE);
+	uint64_t size = (stride * bo->base.v0.height + page_size - 1) / page_size * page_size;
+
+	struct dma_heap_allocation_data heap_alloc = {
+		.len = size,
+		.fd_flags = O_RDWR | O_CLOEXEC,
+	};
+	vulkan_trace_begin("DMA_HEAP_IOCTL_ALLOC size=%"PRIu64, size);
+	int ret = ioctl(vulkan->dma_heap_fd, DMA_HEAP_IOCTL_ALLOC, &heap_alloc);
+	vulkan_trace_end("result=%d", ret);
+	if (ret != 0) {
+		fprintf(stderr, "DMA-BUF heap allocation failed: %s\n", strerror(errno));
+		return false;
+	}
+	int fd = heap_alloc.fd;
+
+	VkSubresourceLayout plane_layout = {
+		.offset = 0,
+		.rowPitch = stride,
+		// Must be 0, the driver computes it
+		.size = 0,
+	};
+	VkImageDrmFormatModifierExplicitCreateInfoEXT explicit_mod = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_EXPLICIT_CREATE_INFO_EXT,
+		.drmFormatModifier = DRM_FORMAT_MOD_LINEAR,
+		.drmFormatModifierPlaneCount = 1,
+		.pPlaneLayouts = &plane_layout,
+	};
+	VkExternalMemoryImageCreateInfo ext_mem = {
+		.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
+		.pNext = &explicit_mod,
+		.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+	};
+	VkImageCreateInfo img_create = vulkan_bo_image_info(bo, format_props, &ext_mem);
+	if (vkCreateImage(vulkan->device, &img_create, NULL, &bo->image) != VK_SUCCESS) {
+		fprintf(stderr, "Driver rejected the layout of a DMA-BUF heap BO, using Vulkan memory\n");
+		bo->image = VK_NULL_HANDLE;
+		goto error_fd;
+	}
+
+	VkMemoryFdPropertiesKHR fd_props = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_FD_PROPERTIES_KHR,
+	};
+	if (vulkan->api.vkGetMemoryFdPropertiesKHR(vulkan->device,
+			VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT, fd, &fd_props) != VK_SUCCESS) {
+		goto error_image;
+	}
+
+	VkMemoryRequirements mem_reqs = {0};
+	vkGetImageMemoryRequirements(vulkan->device, bo->image, &mem_reqs);
+	if (mem_reqs.size > size) {
+		goto error_image;
+	}
+	int mem_type_index = vulkan_find_mem_type(vulkan->physical_device, 0,
+		mem_reqs.memoryTypeBits & fd_props.memoryTypeBits);
+	if (mem_type_index == -1) {
+		goto error_image;
+	}
+
+	// Vulkan takes ownership of the fd on success, so hand it a duplicate
+	int import_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (import_fd == -1) {
+		goto error_image;
+	}
+	VkMemoryDedicatedAllocateInfo dedicated = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO,
+		.image = bo->image,
+	};
+	VkImportMemoryFdInfoKHR import_mem = {
+		.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR,
+		.pNext = &dedicated,
+		.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+		.fd = import_fd,
+	};
+	VkMemoryAllocateInfo mem_alloc = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.pNext = &import_mem,
+		.allocationSize = mem_reqs.size,
+		.memoryTypeIndex = mem_type_index,
+	};
+	if (vkAllocateMemory(vulkan->device, &mem_alloc, NULL, &bo->memory) != VK_SUCCESS) {
+		bo->memory = VK_NULL_HANDLE;
+		close(import_fd);
+		goto error_image;
+	}
 	if (vkBindImageMemory(vulkan->device, bo->image, bo->memory, 0) != VK_SUCCESS) {
-		gbm_vulkan_bo_destroy(&bo->base);
+		vkFreeMemory(vulkan->device, bo->memory, NULL);
+		bo->memory = VK_NULL_HANDLE;
+		goto error_image;
+	}
+	vulkan_stats_add_memory(vulkan, mem_type_index, mem_reqs.size);
+
+	bo->export_fd = fd;
+	bo->modifier = DRM_FORMAT_MOD_LINEAR;
+	bo->system_memory = true;
+	bo->mem_flags = vulkan->mem_props.memoryTypes[mem_type_index].propertyFlags;
+	bo->mem_size = mem_reqs.size;
+	bo->mem_type = mem_type_index;
+	return true;
+
+error_image:
+	vkDestroyImage(vulkan->device, bo->image, NULL);
+	bo->image = VK_NULL_HANDLE;
+error_fd:
+	close(fd);
+	return false;
+}
+
+// BOs for a PRIME display device go to system memory where the driver offers
+// it, as the display device may not be able to reach the VRAM of a discrete
+// GPU. Everything else prefers memory local to the device.
+static int vulkan_bo_find_mem_type(const struct gbm_vulkan_device *vulkan,
+		const struct gbm_vulkan_bo *bo, uint32_t req_bits) {
+	if (bo->prime) {
+		for (uint32_t i = 0; i < vulkan->mem_props.memoryTypeCount; i++) {
+			VkMemoryPropertyFlags flags = vulkan->mem_props.memoryTypes[i].propertyFlags;
+			if ((req_bits & (1u << i)) && (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) &&
+					!(flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)) {
+				return i;
+			}
+		}
+	}
+	return vulkan_find_mem_type(vulkan->physical_device,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, req_bits);
+}
+
+// Creates an image from the given modifier list and backs it with memory. On
+// failure, *chosen is set to the modifier the driver picked if the image
+// could be created, so the caller can retry without it.
+static bool vulkan_bo_try_allocate(struct gbm_vulkan_device *vulkan, struct gbm_vulkan_bo *bo,
+		const struct vulkan_format_props *format_props,
+		const uint64_t *mods, uint32_t mod_count, uint64_t *chosen) {
+	*chosen = DRM_FORMAT_MOD_INVALID;
+
+	VkImageCompressionControlEXT compression = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_COMPRESSION_CONTROL_EXT,
+		.flags = bo->compression == GBM_VULKAN_COMPRESSION_DISABLED ?
+			VK_IMAGE_COMPRESSION_DISABLED_EXT : VK_IMAGE_COMPRESSION_FIXED_RATE_DEFAULT_EXT,
+	};
+	VkImageDrmFormatModifierListCreateInfoEXT drm_format_mod = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_LIST_CREATE_INFO_EXT,
+		.pNext = vulkan->has_compression_control &&
+			bo->compression != GBM_VULKAN_COMPRESSION_DEFAULT ? &compression : NULL,
+		.drmFormatModifierCount = mod_count,
+		.pDrmFormatModifiers = mods,
+	};
+	VkExternalMemoryImageCreateInfo ext_mem = {
+		.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
+		.pNext = &drm_format_mod,
+		.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+	};
+	VkImageCreateInfo img_create = vulkan_bo_image_info(bo, format_props, &ext_mem);
+
+	if (vkCreateImage(vulkan->device, &img_create, NULL, &bo->image) != VK_SUCCESS) {
+		bo->image = VK_NULL_HANDLE;
+		return false;
+	}
+
+	VkImageDrmFormatModifierPropertiesEXT img_mod_props = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_PROPERTIES_EXT,
+	};
+	if (vulkan->api.vkGetImageDrmFormatModifierPropertiesEXT(
+				vulkan->device, bo->image, &img_mod_props) != VK_SUCCESS) {
+		goto error_image;
+	}
+	*chosen = img_mod_props.drmFormatModifier;
+
+	VkMemoryRequirements mem_reqs = {0};
+	vkGetImageMemoryRequirements(vulkan->device, bo->image, &mem_reqs);
+
+	int mem_type_index = vulkan_bo_find_mem_type(vulkan, bo, mem_reqs.memoryTypeBits);
+	if (mem_type_index == -1) {
+		goto error_image;
+	}
+
+	// Memory of a recently destroyed BO that the image fits in saves
+	// going through the kernel allocator
+	VkDeviceSize mem_size = mem_reqs.size;
+	bo->memory = vulkan_memory_cache_take(vulkan, mem_type_index, *chosen, mem_reqs.size, &mem_size);
+	if (bo->memory != VK_NULL_HANDLE && vulkan->debug) {
+		fprintf(stderr, "Reusing %"PRIu64" bytes of memory for %"PRIu64" byte image\n",
+			(uint64_t)mem_size, (uint64_t)mem_reqs.size);
+	}
+
+	VkExportMemoryAllocateInfo export_mem = {
+		.sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO,
+		.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+	};
+	VkMemoryAllocateInfo mem_alloc = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.pNext = &export_mem,
+		.allocationSize = mem_reqs.size,
+		.memoryTypeIndex = mem_type_index,
+	};
+
+	if (bo->memory == VK_NULL_HANDLE) {
+		vulkan_trace_begin("vkAllocateMemory size=%"PRIu64" type=%d",
+			(uint64_t)mem_reqs.size, mem_type_index);
+		VkResult res = vkAllocateMemory(vulkan->device, &mem_alloc, NULL, &bo->memory);
+		vulkan_trace_end("result=%d", res);
+		if (res != VK_SUCCESS) {
+			bo->memory = VK_NULL_HANDLE;
+			goto error_image;
+		}
+		vulkan_stats_add_memory(vulkan, mem_type_index, mem_size);
+	}
+
+	if (vkBindImageMemory(vulkan->device, bo->image, bo->memory, 0) != VK_SUCCESS) {
+		vkFreeMemory(vulkan->device, bo->memory, NULL);
+		vulkan_stats_sub_memory(vulkan, mem_type_index, mem_size);
+		bo->memory = VK_NULL_HANDLE;
+		goto error_image;
+	}
+
+	bo->modifier = img_mod_props.drmFormatModifier;
+	bo->mem_flags = vulkan->mem_props.memoryTypes[mem_type_index].propertyFlags;
+	bo->mem_size = mem_size;
+	bo->system_memory = vulkan->integrated ||
+		!(bo->mem_flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	bo->mem_type = mem_type_index;
+	return true;
+
+error_image:
+	vkDestroyImage(vulkan->device, bo->image, NULL);
+	bo->image = VK_NULL_HANDLE;
+	return false;
+}
+
+// Walks the ranked candidates tier by tier. Within a tier the driver picks,
+// and a modifier that fails to allocate is dropped before retrying, so each
+// attempt uses a strictly smaller set than the one before it.
+static bool vulkan_bo_allocate_ranked(struct gbm_vulkan_device *vulkan, struct gbm_vulkan_bo *bo,
+		const struct vulkan_format_props *format_props,
+		const struct vulkan_modifier_candidate *candidates, size_t count) {
+	int attempts = 0;
+	size_t start = 0;
+	while (start < count) {
+		size_t end = start;
+		while (end < count && candidates[end].tier == candidates[start].tier) {
+			end++;
+		}
+
+		uint64_t mods[end - start];
+		uint32_t mod_count = 0;
+		for (size_t idx = start; idx < end; idx++) {
+			mods[mod_count++] = candidates[idx].props->props.drmFormatModifier;
+		}
+
+		while (mod_count > 0) {
+			uint64_t chosen;
+			attempts++;
+			vulkan_trace_begin("try_allocate modifiers=%"PRIu32, mod_count);
+			bool allocated = vulkan_bo_try_allocate(vulkan, bo, format_props, mods, mod_count,
+				&chosen);
+			vulkan_trace_end("modifier=0x%016"PRIX64" allocated=%d", chosen, allocated);
+			if (allocated) {
+				if (vulkan->debug) {
+					char *modifier_name = drmGetFormatModifierName(chosen);
+					fprintf(stderr, "Allocated %"PRIu32"x%"PRIu32" BO with modifier %s "
+						"(0x%016"PRIX64") after %d attempt(s)\n",
+						bo->base.v0.width, bo->base.v0.height,
+						modifier_name ? modifier_name : "<unknown>", chosen, attempts);
+					free(modifier_name);
+				}
+				return true;
+			}
+			if (chosen == DRM_FORMAT_MOD_INVALID) {
+				// The image could not be created from this set at all
+				break;
+			}
+
+			if (vulkan->debug) {
+				fprintf(stderr, "Allocation with modifier 0x%016"PRIX64" failed, retrying without it\n",
+					chosen);
+			}
+			for (uint32_t idx = 0; idx < mod_count; idx++) {
+				if (mods[idx] == chosen) {
+					mods[idx] = mods[--mod_count];
+					break;
+				}
+			}
+		}
+		start = end;
+	}
+
+	fprintf(stderr, "Could not allocate BO with any of %zu modifiers\n", count);
+	return false;
+}
+
+// Returns the GBM_VULKAN_COMPRESSION_* that the driver applied to a BO.
+// Without VK_EXT_image_compression_control, only the modifier tells.
+static uint32_t vulkan_bo_query_compression(struct gbm_vulkan_device *vulkan,
+		const struct gbm_vulkan_bo *bo, const struct vulkan_format_modifier_props *mod_props) {
+	if (!vulkan->has_compression_control) {
+		return mod_props->mod_class == VULKAN_MODIFIER_COMPRESSED ?
+			GBM_VULKAN_COMPRESSION_DEFAULT : GBM_VULKAN_COMPRESSION_DISABLED;
+	}
+
+	VkImageCompressionPropertiesEXT compression_props = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_COMPRESSION_PROPERTIES_EXT,
+	};
+	VkSubresourceLayout2EXT layout = {
+		.sType = VK_STRUCTURE_TYPE_SUBRESOURCE_LAYOUT_2_EXT,
+		.pNext = &compression_props,
+	};
+	VkImageSubresource2EXT subres = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_SUBRESOURCE_2_EXT,
+		.imageSubresource = {
+			.aspectMask = VK_IMAGE_ASPECT_MEMORY_PLANE_0_BIT_EXT,
+		},
+	};
+	vulkan->api.vkGetImageSubresourceLayout2EXT(vulkan->device, bo->image, &subres, &layout);
+	if (compression_props.imageCompressionFlags &
+			(VK_IMAGE_COMPRESSION_FIXED_RATE_DEFAULT_EXT | VK_IMAGE_COMPRESSION_FIXED_RATE_EXPLICIT_EXT)) {
+		return GBM_VULKAN_COMPRESSION_FIXED_RATE;
+	}
+	if (compression_props.imageCompressionFlags & VK_IMAGE_COMPRESSION_DISABLED_EXT) {
+		return GBM_VULKAN_COMPRESSION_DISABLED;
+	}
+	return GBM_VULKAN_COMPRESSION_DEFAULT;
+}
+
+static struct gbm_bo *vulkan_bo_create(struct gbm_device *gbm,
+		uint32_t width, uint32_t height, uint32_t format, uint32_t usage,
+		const uint64_t *modifiers, const unsigned int count, uint32_t compression) {
+	struct gbm_vulkan_device *vulkan = gbm_vulkan_device(gbm);
+
+	format = core->v0.format_canonicalize(format);
+
+	if (usage & GBM_BO_USE_PROTECTED) {
+		fprintf(stderr, "Cannot create protected buffer\n");
+		return NULL;
+	}
+
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo_alloc(gbm, width, height, format);
+	if (bo == NULL) {
 		return NULL;
 	}
+	bo->compression = compression;
+
+	if (usage & GBM_BO_USE_WRITE) {
+		// Dumb buffers are always linear
+		bool linear_allowed = count == 0;
+		for (unsigned int idx = 0; idx < count; idx++) {
+			if (modifiers[idx] == DRM_FORMAT_MOD_LINEAR ||
+					modifiers[idx] == DRM_FORMAT_MOD_INVALID) {
+				linear_allowed = true;
+			}
+		}
+		if (!linear_allowed) {
+			fprintf(stderr, "Cannot create dumb buffer, linear modifier not allowed\n");
+			gbm_vulkan_bo_destroy(&bo->base);
+			errno = EINVAL;
+			return NULL;
+		}
+		if (!gbm_vulkan_dumb_format_supported(vulkan, format)) {
+			fprintf(stderr, "Cannot create dumb buffer for drm format 0x%08x\n", format);
+			gbm_vulkan_bo_destroy(&bo->base);
+			return NULL;
+		}
+		if (!gbm_vulkan_bo_create_dumb(vulkan, bo)) {
+			gbm_vulkan_bo_destroy(&bo->base);
+			return NULL;
+		}
+		bo->compression = GBM_VULKAN_COMPRESSION_DISABLED;
+		return &bo->base;
+	}
+
+	const struct vulkan_format_props *format_props =
+		vulkan_format_props_from_drm(vulkan, format);
+	if (!format_props) {
+		fprintf(stderr, "no matching drm format 0x%08x available\n", format);
+		gbm_vulkan_bo_destroy(&bo->base);
+		return NULL;
+	}
+	if (!(format_props->supported_usage & vulkan_usage_bit(usage))) {
+		fprintf(stderr, "usage 0x%08x not supported for drm format 0x%08x\n", usage, format);
+		gbm_vulkan_bo_destroy(&bo->base);
+		return NULL;
+	}
+
+	// A list holding only DRM_FORMAT_MOD_INVALID means the caller has no
+	// preference, just like no list at all.
+	unsigned int explicit_count = count;
+	if (explicit_count == 1 && modifiers[0] == DRM_FORMAT_MOD_INVALID) {
+		explicit_count = 0;
+	}
+
+	bool render = usage & GBM_BO_USE_RENDERING;
+	uint32_t supported_count = render ?
+		format_props->render_mod_count : format_props->texture_mod_count;
+	size_t max_candidates = explicit_count > 0 ? explicit_count : supported_count;
+	if (max_candidates == 0) {
+		fprintf(stderr, "no modifiers available for drm format 0x%08x\n", format);
+		gbm_vulkan_bo_destroy(&bo->base);
+		return NULL;
+	}
+
+	size_t candidate_count = 0;
+	struct vulkan_modifier_candidate candidates[max_candidates];
+	if (explicit_count > 0) {
+		candidate_count = vulkan_filter_modifiers(vulkan, format_props, width, height,
+			usage, modifiers, explicit_count, candidates);
+	} else {
+		candidate_count = vulkan_select_implicit_modifiers(vulkan, format_props,
+			width, height, usage, candidates);
+	}
+	bo->prime = vulkan->prime_display && (usage & GBM_BO_USE_SCANOUT);
+	size_t kept = 0;
+	for (size_t idx = 0; idx < candidate_count; idx++) {
+		const struct vulkan_format_modifier_props *props = candidates[idx].props;
+		// Compression control only covers what the driver does within a
+		// layout, modifiers with metadata planes are compressed regardless
+		if (compression == GBM_VULKAN_COMPRESSION_DISABLED &&
+				props->mod_class == VULKAN_MODIFIER_COMPRESSED) {
+			continue;
+		}
+		candidates[kept++] = candidates[idx];
+	}
+	candidate_count = kept;
+	vulkan_rank_modifiers(candidates, candidate_count);
+
+	uint64_t start_ns = get_time_ns();
+	bool allocated = false;
+	if (gbm_vulkan_dma_heap_wanted(vulkan, usage)) {
+		for (size_t idx = 0; idx < candidate_count; idx++) {
+			if (candidates[idx].props->props.drmFormatModifier == DRM_FORMAT_MOD_LINEAR) {
+				allocated = gbm_vulkan_bo_create_dma_heap(vulkan, bo, format_props);
+				break;
+			}
+		}
+	}
+	if (!allocated && !vulkan_bo_allocate_ranked(vulkan, bo, format_props,
+			candidates, candidate_count)) {
+		gbm_vulkan_bo_destroy(&bo->base);
+		return NULL;
+	}
+	if (vulkan->debug) {
+		fprintf(stderr, "Allocated %"PRIu32"x%"PRIu32" BO from %s in %"PRIu64" us\n",
+			width, height, allocated ? "DMA-BUF heap" : "Vulkan",
+			(get_time_ns() - start_ns) / 1000);
+	}
+
+	const struct vulkan_format_modifier_props *mod_props =
+		vulkan_format_props_find_modifier(format_props, bo->modifier, usage & GBM_BO_USE_RENDERING);
+	assert(mod_props != NULL);
+	bo->plane_cnt = mod_props->props.drmFormatModifierPlaneCount;
+
+	for (size_t idx = 0; idx < bo->plane_cnt; idx++) {
+		const VkImageAspectFlagBits plane_aspects[] = {
+			VK_IMAGE_ASPECT_MEMORY_PLANE_0_BIT_EXT,
+			VK_IMAGE_ASPECT_MEMORY_PLANE_1_BIT_EXT,
+			VK_IMAGE_ASPECT_MEMORY_PLANE_2_BIT_EXT,
+			VK_IMAGE_ASPECT_MEMORY_PLANE_3_BIT_EXT,
+		};
+
+		VkImageSubresource img_subres = {
+			.aspectMask = plane_aspects[idx],
+		};
+		VkSubresourceLayout subres_layout = {0};
+		vkGetImageSubresourceLayout(vulkan->device, bo->image, &img_subres, &subres_layout);
+		bo->strides[idx] = subres_layout.rowPitch;
+		bo->offsets[idx] = subres_layout.offset;
+	}
+	bo->compression = vulkan_bo_query_compression(vulkan, bo, mod_props);
+
+	return &bo->base;
+}
+
+static bool vulkan_warm_key_matches(const struct vulkan_warm_key *key,
+		uint32_t width, uint32_t height, uint32_t format, uint32_t usage,
+		const uint64_t *modifiers, unsigned count) {
+	return key->width == width && key->height == height && key->format == format &&
+		key->usage == usage && key->modifier_count == count &&
+		(count == 0 || memcmp(key->modifiers, modifiers, count * sizeof(*modifiers)) == 0);
+}
+
+static bool vulkan_warm_key_init(struct vulkan_warm_key *key,
+		uint32_t width, uint32_t height, uint32_t format, uint32_t usage,
+		const uint64_t *modifiers, unsigned count) {
+	*key = (struct vulkan_warm_key){
+		.width = width,
+		.height = height,
+		.format = format,
+		.usage = usage,
+	};
+	if (count > 0) {
+		key->modifiers = malloc(count * sizeof(*modifiers));
+		if (key->modifiers == NULL) {
+			return false;
+		}
+		memcpy(key->modifiers, modifiers, count * sizeof(*modifiers));
+		key->modifier_count = count;
+	}
+	return true;
+}
+
+static void vulkan_warm_key_finish(struct vulkan_warm_key *key) {
+	free(key->modifiers);
+	*key = (struct vulkan_warm_key){0};
+}
+
+// Hashes a configuration except for its size
+static uint64_t vulkan_warm_key_hash(uint32_t format, uint32_t usage,
+		const uint64_t *modifiers, unsigned count) {
+	// FNV-1a over the fields, good enough to tell configurations apart
+	uint64_t hash = 0xcbf29ce484222325;
+	uint64_t fields[] = { format, usage, count };
+	for (size_t idx = 0; idx < ARRAY_SIZE(fields) + count; idx++) {
+		hash ^= idx < ARRAY_SIZE(fields) ? fields[idx] : modifiers[idx - ARRAY_SIZE(fields)];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+static uint64_t gbm_vulkan_bo_size(const struct gbm_vulkan_bo *bo) {
+	if (bo->dumb) {
+		return bo->dumb->size;
+	}
+	if (bo->mem_size) {
+		return bo->mem_size;
+	}
+	return (uint64_t)bo->strides[0] * bo->base.v0.height;
+}
+
+static void *vulkan_warm_pool_run(void *data) {
+	struct gbm_vulkan_device *dev = data;
+	struct vulkan_warm_pool *pool = &dev->warm;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->pending_count == 0 && !pool->stopping) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+		if (pool->stopping) {
+			break;
+		}
+		struct vulkan_warm_key key = pool->pending;
+		uint32_t target = pool->pending_count;
+		pool->pending = (struct vulkan_warm_key){0};
+		pool->pending_count = 0;
+
+		// BOs of an earlier configuration are not going to be asked for
+		// anymore, e.g. after a resize
+		struct gbm_vulkan_bo *stale[VULKAN_WARM_MAX_BOS];
+		uint32_t stale_count = 0;
+		if (vulkan_warm_key_matches(&pool->ready_key, key.width, key.height, key.format,
+				key.usage, key.modifiers, key.modifier_count)) {
+			vulkan_warm_key_finish(&key);
+		} else {
+			memcpy(stale, pool->ready, pool->ready_count * sizeof(*stale));
+			stale_count = pool->ready_count;
+			pool->ready_count = 0;
+			pool->ready_bytes = 0;
+			vulkan_warm_key_finish(&pool->ready_key);
+			pool->ready_key = key;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		for (uint32_t idx = 0; idx < stale_count; idx++) {
+			gbm_vulkan_bo_destroy(&stale[idx]->base);
+		}
+
+		// Only this thread changes ready_key, so it can be read unlocked
+		const struct vulkan_warm_key *ready_key = &pool->ready_key;
+		const struct pixel_format_info *info = drm_get_pixel_format_info(ready_key->format);
+		uint64_t estimate = (uint64_t)ready_key->width * ready_key->height *
+			(info ? info->bytes_per_block : 4);
+		pthread_mutex_lock(&pool->lock);
+		while (pool->ready_count < target && pool->pending_count == 0 && !pool->stopping &&
+				pool->ready_bytes + estimate <= pool->budget) {
+			pthread_mutex_unlock(&pool->lock);
+			struct gbm_bo *bo = vulkan_bo_create(&dev->base, ready_key->width, ready_key->height,
+				ready_key->format, ready_key->usage, ready_key->modifiers,
+				ready_key->modifier_count, GBM_VULKAN_COMPRESSION_DEFAULT);
+			pthread_mutex_lock(&pool->lock);
+			if (bo == NULL) {
+				break;
+			}
+			pool->ready[pool->ready_count++] = gbm_vulkan_bo(bo);
+			pool->ready_bytes += gbm_vulkan_bo_size(gbm_vulkan_bo(bo));
+		}
+		if (dev->debug) {
+			fprintf(stderr, "Warm pool holds %"PRIu32" %"PRIu32"x%"PRIu32" BOs\n",
+				pool->ready_count, ready_key->width, ready_key->height);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+// Asks the worker to have bo_count BOs of the configuration ready,
+// superseding earlier requests. Called with the pool lock held.
+static bool vulkan_warm_pool_request_locked(struct gbm_vulkan_device *dev,
+		uint32_t width, uint32_t height, uint32_t format, uint32_t usage,
+		const uint64_t *modifiers, unsigned count, uint32_t bo_count) {
+	struct vulkan_warm_pool *pool = &dev->warm;
+	if (!pool->started) {
+		int err = pthread_create(&pool->thread, NULL, vulkan_warm_pool_run, dev);
+		if (err != 0) {
+			fprintf(stderr, "Could not start warm pool thread: %s\n", strerror(err));
+			errno = err;
+			return false;
+		}
+		pool->started = true;
+	}
+
+	vulkan_warm_key_finish(&pool->pending);
+	if (!vulkan_warm_key_init(&pool->pending, width, height, format, usage, modifiers, count)) {
+		pool->pending_count = 0;
+		return false;
+	}
+	pool->pending_count = bo_count < VULKAN_WARM_MAX_BOS ? bo_count : VULKAN_WARM_MAX_BOS;
+	pthread_cond_signal(&pool->cond);
+	return true;
+}
+
+// Hands out a pre-created BO matching the request, if there is one, and
+// predicts upcoming allocations. Only resizes are predicted: when the size
+// changes but format, usage and modifiers stay the same, and the previous
+// size came in a run of several BOs, the client is most likely recreating a
+// swapchain of that many, so the rest of the run is created in the
+// background. Other changes of configuration predict nothing.
+static struct gbm_vulkan_bo *vulkan_warm_pool_take(struct gbm_vulkan_device *dev,
+		uint32_t width, uint32_t height, uint32_t format, uint32_t usage,
+		const uint64_t *modifiers, unsigned count) {
+	struct vulkan_warm_pool *pool = &dev->warm;
+	if (pool->budget == 0) {
+		return NULL;
+	}
+
+	uint64_t hash = vulkan_warm_key_hash(format, usage, modifiers, count);
+	struct gbm_vulkan_bo *bo = NULL;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->ready_count > 0 && vulkan_warm_key_matches(&pool->ready_key,
+			width, height, format, usage, modifiers, count)) {
+		bo = pool->ready[--pool->ready_count];
+		pool->ready_bytes -= gbm_vulkan_bo_size(bo);
+	}
+
+	if (hash == pool->last_hash && width == pool->last_width && height == pool->last_height) {
+		pool->run++;
+	} else {
+		bool resized = hash == pool->last_hash;
+		if (bo == NULL && resized && pool->run > 1) {
+			vulkan_warm_pool_request_locked(dev, width, height, format, usage,
+				modifiers, count, pool->run - 1);
+		}
+		pool->last_hash = hash;
+		pool->last_width = width;
+		pool->last_height = height;
+		pool->run = 1;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	vulkan_stats_count(bo != NULL ? &dev->stats.warm_pool_hits : &dev->stats.warm_pool_misses);
+	if (bo != NULL && dev->debug) {
+		fprintf(stderr, "Took %"PRIu32"x%"PRIu32" BO from warm pool\n", width, height);
+	}
+	return bo;
+}
+
+static void vulkan_warm_pool_finish(struct gbm_vulkan_device *dev) {
+	struct vulkan_warm_pool *pool = &dev->warm;
+	if (pool->started) {
+		pthread_mutex_lock(&pool->lock);
+		pool->stopping = true;
+		pthread_cond_signal(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+		pthread_join(pool->thread, NULL);
+	}
+	for (uint32_t idx = 0; idx < pool->ready_count; idx++) {
+		gbm_vulkan_bo_destroy(&pool->ready[idx]->base);
+	}
+	vulkan_warm_key_finish(&pool->pending);
+	vulkan_warm_key_finish(&pool->ready_key);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+static struct gbm_bo *gbm_vulkan_bo_create(struct gbm_device *gbm,
+		uint32_t width, uint32_t height, uint32_t format, uint32_t usage,
+		const uint64_t *modifiers, const unsigned int count) {
+	struct gbm_vulkan_device *vulkan = gbm_vulkan_device(gbm);
+	uint64_t start_ns = get_time_ns();
+	format = core->v0.format_canonicalize(format);
+	vulkan_trace_begin("bo_create %"PRIu32"x%"PRIu32" format=0x%08"PRIX32" usage=0x%"PRIx32
+		" modifiers=%u", width, height, format, usage, count);
+
+	struct gbm_vulkan_bo *bo = vulkan_warm_pool_take(vulkan, width, height, format, usage,
+		modifiers, count);
+	struct gbm_bo *created = bo != NULL ? &bo->base :
+		vulkan_bo_create(gbm, width, height, format, usage, modifiers, count,
+			GBM_VULKAN_COMPRESSION_DEFAULT);
+	if (created != NULL) {
+		vulkan_stats_count(&vulkan->stats.creates);
+	}
+	vulkan_stats_record(vulkan, GBM_VULKAN_STATS_OP_CREATE, start_ns);
+	vulkan_trace_end_bo(created);
+	return created;
+}
+
+struct gbm_bo *gbm_vulkan_bo_create_with_compression(struct gbm_device *gbm,
+		uint32_t width, uint32_t height, uint32_t format, const uint64_t *modifiers,
+		unsigned count, uint32_t flags, uint32_t compression) {
+	struct gbm_vulkan_device *vulkan = gbm_vulkan_device(gbm);
+	if (compression > GBM_VULKAN_COMPRESSION_FIXED_RATE) {
+		errno = EINVAL;
+		return NULL;
+	}
+	uint64_t start_ns = get_time_ns();
+	vulkan_trace_begin("bo_create %"PRIu32"x%"PRIu32" format=0x%08"PRIX32" usage=0x%"PRIx32
+		" modifiers=%u compression=%"PRIu32, width, height, format, flags, count, compression);
+	struct gbm_bo *bo = vulkan_bo_create(gbm, width, height, format, flags, modifiers, count,
+		compression);
+	if (bo != NULL) {
+		vulkan_stats_count(&vulkan->stats.creates);
+	}
+	vulkan_stats_record(vulkan, GBM_VULKAN_STATS_OP_CREATE, start_ns);
+	vulkan_trace_end_bo(bo);
+	return bo;
+}
+
+uint32_t gbm_vulkan_bo_get_compression(struct gbm_bo *bo) {
+	return gbm_vulkan_bo(bo)->compression;
+}
+
+int gbm_vulkan_device_prewarm(struct gbm_device *gbm, uint32_t width, uint32_t height,
+		uint32_t format, const uint64_t *modifiers, unsigned count, uint32_t flags,
+		uint32_t bo_count) {
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(gbm);
+	struct vulkan_warm_pool *pool = &dev->warm;
+	if (pool->budget == 0) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	format = core->v0.format_canonicalize(format);
+
+	pthread_mutex_lock(&pool->lock);
+	bool ok = vulkan_warm_pool_request_locked(dev, width, height, format, flags,
+		modifiers, count, bo_count);
+	pthread_mutex_unlock(&pool->lock);
+	return ok ? 0 : -1;
+}
+
+// Creates count BOs with the modifier and plane layout of proto. The
+// images are created from the explicit layout, so they cannot end up with a
+// different one, and identical images share their memory requirements.
+static bool vulkan_bo_create_batch_images(struct gbm_vulkan_device *vulkan,
+		const struct gbm_vulkan_bo *proto, struct gbm_bo **bos, uint32_t count) {
+	const struct vulkan_format_props *format_props =
+		vulkan_format_props_from_drm(vulkan, proto->base.v0.format);
+	assert(format_props != NULL);
+
+	VkSubresourceLayout plane_layouts[GBM_MAX_PLANES] = {0};
+	for (size_t idx = 0; idx < proto->plane_cnt; idx++) {
+		plane_layouts[idx].offset = proto->offsets[idx];
+		plane_layouts[idx].rowPitch = proto->strides[idx];
+	}
+	VkImageDrmFormatModifierExplicitCreateInfoEXT explicit_mod = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_EXPLICIT_CREATE_INFO_EXT,
+		.drmFormatModifier = proto->modifier,
+		.drmFormatModifierPlaneCount = proto->plane_cnt,
+		.pPlaneLayouts = plane_layouts,
+	};
+	VkExternalMemoryImageCreateInfo ext_mem = {
+		.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
+		.pNext = &explicit_mod,
+		.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+	};
+	VkImageCreateInfo img_create = vulkan_bo_image_info(proto, format_props, &ext_mem);
+
+	assert(count < GBM_VULKAN_BATCH_MAX_BOS);
+	struct gbm_vulkan_bo *batch[GBM_VULKAN_BATCH_MAX_BOS];
+	VkBindImageMemoryInfo binds[GBM_VULKAN_BATCH_MAX_BOS];
+	VkMemoryRequirements mem_reqs = {0};
+	int mem_type_index = -1;
+	uint32_t created = 0;
+	for (uint32_t idx = 0; idx < count; idx++) {
+		struct gbm_vulkan_bo *bo = gbm_vulkan_bo_alloc(&vulkan->base,
+			proto->base.v0.width, proto->base.v0.height, proto->base.v0.format);
+		if (bo == NULL) {
+			goto error;
+		}
+		batch[created++] = bo;
+		if (vkCreateImage(vulkan->device, &img_create, NULL, &bo->image) != VK_SUCCESS) {
+			bo->image = VK_NULL_HANDLE;
+			goto error;
+		}
+		if (mem_type_index == -1) {
+			vkGetImageMemoryRequirements(vulkan->device, bo->image, &mem_reqs);
+			mem_type_index = vulkan_bo_find_mem_type(vulkan, proto, mem_reqs.memoryTypeBits);
+			if (mem_type_index == -1) {
+				goto error;
+			}
+		}
+
+		VkExportMemoryAllocateInfo export_mem = {
+			.sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO,
+			.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+		};
+		VkMemoryAllocateInfo mem_alloc = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+			.pNext = &export_mem,
+			.allocationSize = mem_reqs.size,
+			.memoryTypeIndex = mem_type_index,
+		};
+		if (vkAllocateMemory(vulkan->device, &mem_alloc, NULL, &bo->memory) != VK_SUCCESS) {
+			bo->memory = VK_NULL_HANDLE;
+			goto error;
+		}
+		bo->mem_size = mem_reqs.size;
+		bo->mem_type = mem_type_index;
+		vulkan_stats_add_memory(vulkan, mem_type_index, mem_reqs.size);
+		binds[idx] = (VkBindImageMemoryInfo){
+			.sType = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO,
+			.image = bo->image,
+			.memory = bo->memory,
+		};
+	}
+	if (vkBindImageMemory2(vulkan->device, count, binds) != VK_SUCCESS) {
+		goto error;
+	}
+
+	for (uint32_t idx = 0; idx < count; idx++) {
+		struct gbm_vulkan_bo *bo = batch[idx];
+		bo->modifier = proto->modifier;
+		bo->plane_cnt = proto->plane_cnt;
+		memcpy(bo->strides, proto->strides, sizeof(bo->strides));
+		memcpy(bo->offsets, proto->offsets, sizeof(bo->offsets));
+		bo->mem_flags = vulkan->mem_props.memoryTypes[mem_type_index].propertyFlags;
+		bo->compression = proto->compression;
+		bo->prime = proto->prime;
+		bo->system_memory = proto->system_memory;
+		bos[idx] = &bo->base;
+	}
+	return true;
+
+error:
+	fprintf(stderr, "Could not allocate batch of %"PRIu32" BOs\n", count);
+	for (uint32_t idx = 0; idx < created; idx++) {
+		gbm_vulkan_bo_destroy(&batch[idx]->base);
+	}
+	return false;
+}
+
+int gbm_vulkan_bo_create_batch(struct gbm_device *gbm, uint32_t width, uint32_t height,
+		uint32_t format, const uint64_t *modifiers, unsigned count, uint32_t flags,
+		uint32_t bo_count, struct gbm_bo **bos) {
+	struct gbm_vulkan_device *vulkan = gbm_vulkan_device(gbm);
+	if (bo_count == 0 || bo_count > GBM_VULKAN_BATCH_MAX_BOS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// The first BO negotiates the modifier, the rest copy its layout
+	uint64_t start_ns = get_time_ns();
+	vulkan_trace_begin("bo_create_batch %"PRIu32"x%"PRIu32" format=0x%08"PRIX32" usage=0x%"PRIx32
+		" modifiers=%u count=%"PRIu32, width, height, format, flags, count, bo_count);
+	uint32_t created = 0;
+	bos[0] = vulkan_bo_create(gbm, width, height, format, flags, modifiers, count,
+		GBM_VULKAN_COMPRESSION_DEFAULT);
+	if (bos[0] == NULL) {
+		goto error;
+	}
+	struct gbm_vulkan_bo *proto = gbm_vulkan_bo(bos[0]);
+	created = 1;
+	// Dumb buffers and BOs from the DMA-BUF heap, which come with their
+	// dma-buf, are not Vulkan allocations. Those are allocated one by one.
+	if (proto->dumb || proto->export_fd >= 0) {
+		for (; created < bo_count; created++) {
+			bos[created] = vulkan_bo_create(gbm, width, height, format, flags,
+				&proto->modifier, 1, GBM_VULKAN_COMPRESSION_DEFAULT);
+			if (bos[created] == NULL) {
+				goto error;
+			}
+		}
+	} else if (bo_count > 1 &&
+			!vulkan_bo_create_batch_images(vulkan, proto, bos + 1, bo_count - 1)) {
+		goto error;
+	}
+	atomic_fetch_add_explicit(&vulkan->stats.creates, bo_count, memory_order_relaxed);
+	vulkan_stats_record(vulkan, GBM_VULKAN_STATS_OP_CREATE, start_ns);
+	vulkan_trace_end("first_bo=%"PRIu64" modifier=0x%016"PRIX64, proto->id, proto->modifier);
+	return 0;
+
+error:
+	for (uint32_t idx = 0; idx < created; idx++) {
+		gbm_vulkan_bo_destroy(bos[idx]);
+	}
+	vulkan_stats_record(vulkan, GBM_VULKAN_STATS_OP_CREATE, start_ns);
+	vulkan_trace_end("failed");
+	return -1;
+}
+
+// A view may drop alpha, reinterpreting e.g. ARGB8888 as XRGB8888, or keep
+// the format to get an image that can also be viewed as sRGB
+static bool vulkan_view_format_compatible(uint32_t parent_format, uint32_t format) {
+	if (parent_format == format) {
+		return true;
+	}
+	const struct pixel_format_info *info = drm_get_pixel_format_info(parent_format);
+	return info != NULL && info->opaque_substitute == format;
+}
+
+// Creates the image of a view, aliasing the memory of its parent. The image
+// is mutable between the formats of both and the sRGB variant.
+// Checks the exact image a view would create against the parent's modifier
+static bool vulkan_view_image_supported(VkPhysicalDevice phdev,
+		const VkImageCreateInfo *img_create, uint64_t modifier,
+		const VkImageFormatListCreateInfo *format_list) {
+	VkPhysicalDeviceImageDrmFormatModifierInfoEXT modi = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT,
+		.pNext = format_list,
+		.drmFormatModifier = modifier,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+	};
+	VkPhysicalDeviceExternalImageFormatInfo efmti = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_IMAGE_FORMAT_INFO,
+		.pNext = &modi,
+		.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+	};
+	VkPhysicalDeviceImageFormatInfo2 fmti = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2,
+		.pNext = &efmti,
+		.type = img_create->imageType,
+		.format = img_create->format,
+		.tiling = img_create->tiling,
+		.usage = img_create->usage,
+		.flags = img_create->flags,
+	};
+	VkExternalImageFormatProperties efmtp = {
+		.sType = VK_STRUCTURE_TYPE_EXTERNAL_IMAGE_FORMAT_PROPERTIES,
+	};
+	VkImageFormatProperties2 ifmtp = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2,
+		.pNext = &efmtp,
+	};
+	if (vkGetPhysicalDeviceImageFormatProperties2(phdev, &fmti, &ifmtp) != VK_SUCCESS) {
+		return false;
+	}
+	return efmtp.externalMemoryProperties.externalMemoryFeatures &
+		VK_EXTERNAL_MEMORY_FEATURE_IMPORTABLE_BIT;
+}
+
+static VkImage vulkan_bo_view_image(struct gbm_vulkan_device *dev,
+		const struct gbm_vulkan_bo *view, const struct gbm_vulkan_bo *parent) {
+	const struct vulkan_format_props *view_props =
+		vulkan_format_props_from_drm(dev, view->base.v0.format);
+	const struct vulkan_format_props *parent_props =
+		vulkan_format_props_from_drm(dev, parent->base.v0.format);
+	if (view_props == NULL || parent_props == NULL) {
+		return VK_NULL_HANDLE;
+	}
+
+	VkFormat view_formats[3] = { view_props->format.vk };
+	uint32_t view_format_count = 1;
+	if (parent_props->format.vk != view_props->format.vk) {
+		view_formats[view_format_count++] = parent_props->format.vk;
+	}
+	if (view_props->format.vk_srgb) {
+		view_formats[view_format_count++] = view_props->format.vk_srgb;
+	}
+	VkImageFormatListCreateInfo format_list = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_LIST_CREATE_INFO,
+		.viewFormatCount = view_format_count,
+		.pViewFormats = view_formats,
+	};
+	VkSubresourceLayout plane_layouts[GBM_MAX_PLANES] = {0};
+	for (size_t idx = 0; idx < parent->plane_cnt; idx++) {
+		plane_layouts[idx].offset = parent->offsets[idx];
+		plane_layouts[idx].rowPitch = parent->strides[idx];
+	}
+	VkImageDrmFormatModifierExplicitCreateInfoEXT explicit_mod = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_EXPLICIT_CREATE_INFO_EXT,
+		.pNext = &format_list,
+		.drmFormatModifier = parent->modifier,
+		.drmFormatModifierPlaneCount = parent->plane_cnt,
+		.pPlaneLayouts = plane_layouts,
+	};
+	VkExternalMemoryImageCreateInfo ext_mem = {
+		.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
+		.pNext = &explicit_mod,
+		.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+	};
+	VkImageCreateInfo img_create = vulkan_bo_image_info(view, view_props, &ext_mem);
+	if (view_format_count > 1) {
+		img_create.flags |= VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
+	}
+	bool supported = vulkan_view_image_supported(dev->physical_device,
+		&img_create, parent->modifier, &format_list);
+	// The modifier may not allow sRGB views, which the view can do without
+	if (!supported && view_props->format.vk_srgb) {
+		format_list.viewFormatCount = --view_format_count;
+		if (view_format_count == 1) {
+			img_create.flags &= ~VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
+		}
+		supported = vulkan_view_image_supported(dev->physical_device,
+			&img_create, parent->modifier, &format_list);
+	}
+	if (!supported) {
+		return VK_NULL_HANDLE;
+	}
+
+	VkImage image;
+	if (vkCreateImage(dev->device, &img_create, NULL, &image) != VK_SUCCESS) {
+		return VK_NULL_HANDLE;
+	}
+	if (vkBindImageMemory(dev->device, image, parent->memory, 0) != VK_SUCCESS) {
+		vkDestroyImage(dev->device, image, NULL);
+		return VK_NULL_HANDLE;
+	}
+	return image;
+}
+
+struct gbm_bo *gbm_vulkan_bo_create_view(struct gbm_bo *_bo, uint32_t format) {
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
+	struct gbm_vulkan_bo *parent = gbm_vulkan_bo(_bo);
+	// Views of views share the memory of the original BO
+	if (parent->parent) {
+		parent = parent->parent;
+	}
+
+	format = core->v0.format_canonicalize(format);
+	if (!vulkan_view_format_compatible(parent->base.v0.format, format)) {
+		fprintf(stderr, "Cannot view drm format 0x%08x as 0x%08x\n",
+			parent->base.v0.format, format);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct gbm_vulkan_bo *view = gbm_vulkan_bo_alloc(_bo->gbm,
+		parent->base.v0.width, parent->base.v0.height, format);
+	if (view == NULL) {
+		return NULL;
+	}
+	view->plane_cnt = parent->plane_cnt;
+	view->modifier = parent->modifier;
+	memcpy(view->strides, parent->strides, sizeof(view->strides));
+	memcpy(view->offsets, parent->offsets, sizeof(view->offsets));
+	if (parent->import) {
+		view->import = calloc(1, sizeof(*view->import));
+		if (view->import == NULL) {
+			gbm_vulkan_bo_destroy(&view->base);
+			return NULL;
+		}
+		// The fds stay owned by the parent
+		memcpy(view->import->fds, parent->import->fds, sizeof(view->import->fds));
+	}
+	view->dumb = parent->dumb;
+	view->compression = parent->compression;
+	view->prime = parent->prime;
+	view->system_memory = parent->system_memory;
+	if (parent->memory) {
+		view->memory = parent->memory;
+		view->mem_flags = parent->mem_flags;
+		view->mem_size = parent->mem_size;
+		view->mem_type = parent->mem_type;
+		// Without an image of its own, the view is only accessed through
+		// copies, like an imported BO
+		view->image = vulkan_bo_view_image(dev, view, parent);
+		if (view->image == VK_NULL_HANDLE && dev->debug) {
+			fprintf(stderr, "Could not create an image for view 0x%08x of BO %"PRIu64
+				" with modifier 0x%016"PRIX64", falling back to copies\n",
+				format, parent->id, parent->modifier);
+		}
+	}
+
+	atomic_fetch_add(&parent->refs, 1);
+	view->parent = parent;
+	return &view->base;
+}
+
+// Returns the dma-buf of a BO we allocated, exporting it on first use. The
+// fd remains owned by the BO.
+static int gbm_vulkan_bo_export_fd(struct gbm_vulkan_bo *bo) {
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(bo->base.gbm);
+	if (bo->parent) {
+		return gbm_vulkan_bo_export_fd(bo->parent);
+	}
+	if (bo->export_fd >= 0) {
+		return bo->export_fd;
+	}
+
+	int fd;
+	if (bo->dumb) {
+		if (drmPrimeHandleToFD(dev->base.v0.fd, bo->dumb->handle, DRM_CLOEXEC | DRM_RDWR, &fd) != 0) {
+			fprintf(stderr, "Could not export dumb buffer through PRIME\n");
+			return -1;
+		}
+	} else if (bo->memory) {
+		VkMemoryGetFdInfoKHR mem_get_fd = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR,
+			.memory = bo->memory,
+			.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+		};
+		if (dev->api.vkGetMemoryFdKHR(dev->device, &mem_get_fd, &fd) != VK_SUCCESS) {
+			return -1;
+		}
+	} else {
+		fprintf(stderr, "Atempt to get fd for plane without image\n");
+		errno = EINVAL;
+		return -1;
+	}
+
+	// Another thread may have exported it meanwhile
+	int exported = -1;
+	if (!atomic_compare_exchange_strong(&bo->export_fd, &exported, fd)) {
+		close(fd);
+		return exported;
+	}
+	return fd;
+}
+
+static int vulkan_bo_get_fd(struct gbm_bo *_bo) {
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+
+	if (bo->plane_cnt != 1) {
+		fprintf(stderr, "Atempt to get single fd for multi-planar image\n");
+		errno = EINVAL;
+		return -1;
+	}
+	if (bo->import) {
+		// Imports that own their fds keep them, the caller gets a
+		// duplicate. Views share the fds of their parent.
+		const struct gbm_vulkan_bo *owner = bo->parent ? bo->parent : bo;
+		if (owner->import->owned) {
+			return fcntl(bo->import->fds[0], F_DUPFD_CLOEXEC, 0);
+		}
+		return bo->import->fds[0];
+	}
+
+	int fd = gbm_vulkan_bo_export_fd(bo);
+	if (fd == -1) {
+		return -1;
+	}
+	return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+static int vulkan_bo_get_plane_fd(struct gbm_bo *_bo, int plane) {
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+
+	if ((size_t)plane >= bo->plane_cnt) {
+		fprintf(stderr, "Atempt to get fd for invalid plane\n");
+		return -1;
+	}
+	if (bo->import) {
+		const struct gbm_vulkan_bo *owner = bo->parent ? bo->parent : bo;
+		if (owner->import->owned) {
+			return fcntl(bo->import->fds[plane], F_DUPFD_CLOEXEC, 0);
+		}
+		return bo->import->fds[plane];
+	}
+
+	// All planes of BOs we allocate share one dma-buf
+	int fd = gbm_vulkan_bo_export_fd(bo);
+	if (fd == -1) {
+		return -1;
+	}
+	return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+static int gbm_vulkan_bo_get_fd(struct gbm_bo *_bo) {
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
+	uint64_t start_ns = get_time_ns();
+	vulkan_trace_begin("bo_get_fd bo=%"PRIu64, gbm_vulkan_bo(_bo)->id);
+	int fd = vulkan_bo_get_fd(_bo);
+	if (fd >= 0) {
+		vulkan_stats_count(&dev->stats.exports);
+	}
+	vulkan_stats_record(dev, GBM_VULKAN_STATS_OP_GET_FD, start_ns);
+	vulkan_trace_end("fd=%d", fd);
+	return fd;
+}
+
+static int gbm_vulkan_bo_get_plane_fd(struct gbm_bo *_bo, int plane) {
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
+	uint64_t start_ns = get_time_ns();
+	vulkan_trace_begin("bo_get_plane_fd bo=%"PRIu64" plane=%d", gbm_vulkan_bo(_bo)->id, plane);
+	int fd = vulkan_bo_get_plane_fd(_bo, plane);
+	if (fd >= 0) {
+		vulkan_stats_count(&dev->stats.exports);
+	}
+	vulkan_stats_record(dev, GBM_VULKAN_STATS_OP_GET_FD, start_ns);
+	vulkan_trace_end("fd=%d", fd);
+	return fd;
+}
+
+static uint64_t gbm_vulkan_bo_get_modifier(struct gbm_bo *_bo) {
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+	if (!bo->image && !bo->import) {
+		return DRM_FORMAT_MOD_LINEAR;
+	}
+	return bo->modifier;
+}
+
+static union gbm_bo_handle gbm_vulkan_bo_get_handle_for_plane(struct gbm_bo *_bo, int plane) {
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
+	if ((size_t)plane >= bo->plane_cnt) {
+		return (union gbm_bo_handle){0};
+	}
+	if (bo->dumb) {
+		return (union gbm_bo_handle){ .u32 = bo->dumb->handle };
+	}
+
+	int fd = bo->import ? bo->import->fds[plane] : gbm_vulkan_bo_export_fd(bo);
+	if (fd == -1) {
+		return (union gbm_bo_handle){0};
+	}
+
+	union gbm_bo_handle ret = {0};
+	vulkan_trace_begin("drmPrimeFDToHandle bo=%"PRIu64" plane=%d", bo->id, plane);
+	int err = drmPrimeFDToHandle(dev->base.v0.fd, fd, &ret.u32);
+	vulkan_trace_end("handle=%"PRIu32, ret.u32);
+	if (err != 0) {
+		fprintf(stderr, "Could not create handle from PRIME FD\n");
+		return (union gbm_bo_handle){0};
+	}
+
+	return ret;
+}
+
+static uint32_t gbm_vulkan_bo_get_offset(struct gbm_bo *_bo, int plane) {
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+	if ((size_t)plane >= bo->plane_cnt) {
+		errno = EINVAL;
+		return 0;
+	}
+	return bo->offsets[plane];
+}
+
+static uint32_t gbm_vulkan_bo_get_stride(struct gbm_bo *_bo, int plane) {
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+	if ((size_t)plane >= bo->plane_cnt) {
+		errno = EINVAL;
+		return 0;
+	}
+	return bo->strides[plane];
+}
+
+static int gbm_vulkan_bo_get_planes(struct gbm_bo *_bo) {
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+	return bo->plane_cnt;
+}
+
+static int gbm_vulkan_get_format_modifier_plane_count(struct gbm_device *gbm,
+		uint32_t format, uint64_t modifier) {
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(gbm);
+	struct vulkan_format_props *format_props = vulkan_format_props_from_drm(dev, format);
+
+	const struct vulkan_format_modifier_props *mod_props =
+		vulkan_format_props_find_modifier(format_props, modifier, false);
+	if (mod_props == NULL) {
+		errno = EINVAL;
+		return 0;
+	}
+	assert(mod_props != NULL);
+	return mod_props->props.drmFormatModifierPlaneCount;
+}
+
+static int gbm_vulkan_is_format_supported(struct gbm_device *gbm, uint32_t format, uint32_t usage) {
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(gbm);
+	format = core->v0.format_canonicalize(format);
+	struct vulkan_format_props *format_props = vulkan_format_props_from_drm(dev, format);
+	if (format_props == NULL) {
+		// Dumb buffers also cover formats that Vulkan does not know about
+		if ((usage & GBM_BO_USE_WRITE) && !(usage & GBM_BO_USE_PROTECTED) &&
+				gbm_vulkan_dumb_format_supported(dev, format)) {
+			return 1;
+		}
+		errno = EINVAL;
+		return 0;
+	}
+	if (!(format_props->supported_usage & vulkan_usage_bit(usage))) {
+		errno = EINVAL;
+		return 0;
+	}
+	return 1;
+}
+
+static void vulkan_staging_finish(struct gbm_vulkan_device *dev, struct vulkan_staging *staging) {
+	if (staging->buffer) {
+		vkDestroyBuffer(dev->device, staging->buffer, NULL);
+	}
+	if (staging->memory) {
+		vkFreeMemory(dev->device, staging->memory, NULL);
+	}
+	*staging = (struct vulkan_staging){0};
+}
+
+static bool vulkan_staging_ensure(struct gbm_vulkan_device *dev, struct vulkan_staging *staging,
+		VkDeviceSize size) {
+	if (staging->size >= size) {
+		return true;
+	}
+	vulkan_staging_finish(dev, staging);
+
+	// Round up so that slightly larger copies do not reallocate every time
+	size = (size + 0xffff) & ~(VkDeviceSize)0xffff;
+
+	VkBufferCreateInfo buf_info = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = size,
+		.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+	};
+	if (vkCreateBuffer(dev->device, &buf_info, NULL, &staging->buffer) != VK_SUCCESS) {
+		staging->buffer = VK_NULL_HANDLE;
+		return false;
+	}
+
+	VkMemoryRequirements mem_reqs = {0};
+	vkGetBufferMemoryRequirements(dev->device, staging->buffer, &mem_reqs);
+
+	// Cached memory keeps readbacks from crawling through uncached reads
+	int mem_type_index = vulkan_find_mem_type(dev->physical_device,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
+		VK_MEMORY_PROPERTY_HOST_CACHED_BIT, mem_reqs.memoryTypeBits);
+	if (mem_type_index == -1) {
+		mem_type_index = vulkan_find_mem_type(dev->physical_device,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			mem_reqs.memoryTypeBits);
+	}
+	if (mem_type_index == -1) {
+		goto error;
+	}
+
+	VkMemoryAllocateInfo mem_alloc = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.allocationSize = mem_reqs.size,
+		.memoryTypeIndex = mem_type_index,
+	};
+	if (vkAllocateMemory(dev->device, &mem_alloc, NULL, &staging->memory) != VK_SUCCESS) {
+		staging->memory = VK_NULL_HANDLE;
+		goto error;
+	}
+	if (vkBindBufferMemory(dev->device, staging->buffer, staging->memory, 0) != VK_SUCCESS ||
+			vkMapMemory(dev->device, staging->memory, 0, VK_WHOLE_SIZE, 0,
+				(void **)&staging->map) != VK_SUCCESS) {
+		goto error;
+	}
+	staging->size = size;
+	return true;
+
+error:
+	fprintf(stderr, "Could not allocate %"PRIu64" byte staging buffer\n", (uint64_t)size);
+	vulkan_staging_finish(dev, staging);
+	errno = ENOMEM;
+	return false;
+}
+
+// Picks the next slot of the ring, waits for its previous submission and
+// starts recording into it with at least staging_size bytes of staging.
+static struct vulkan_copy_slot *vulkan_copy_begin(struct gbm_vulkan_device *dev,
+		VkDeviceSize staging_size) {
+	struct vulkan_copy_engine *engine = &dev->copy;
+	if (!engine->enabled) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	struct vulkan_copy_slot *slot = NULL;
+	for (uint32_t idx = 0; idx < VULKAN_COPY_SLOT_COUNT && slot == NULL; idx++) {
+		struct vulkan_copy_slot *candidate = &engine->slots[engine->next_slot];
+		engine->next_slot = (engine->next_slot + 1) % VULKAN_COPY_SLOT_COUNT;
+		if (!candidate->held) {
+			slot = candidate;
+		}
+	}
+	assert(slot != NULL);
+	if (!vulkan_copy_wait(dev, slot->point)) {
+		return NULL;
+	}
+	if (staging_size > 0 && !vulkan_staging_ensure(dev, &slot->staging, staging_size)) {
+		return NULL;
+	}
+
+	VkCommandBufferBeginInfo begin_info = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+	};
+	if (vkResetCommandBuffer(slot->cb, 0) != VK_SUCCESS ||
+			vkBeginCommandBuffer(slot->cb, &begin_info) != VK_SUCCESS) {
+		errno = EIO;
+		return NULL;
+	}
+	return slot;
+}
+
+// Submits the slot and returns the timeline point that signals its
+// completion, or 0 on failure. The submission waits for the first
+// wait_count of the slot's wait semaphores, and signals the slot's fence as
+// well if signal_fence is set.
+static uint64_t vulkan_copy_submit(struct gbm_vulkan_device *dev, struct vulkan_copy_slot *slot,
+		uint32_t wait_count, bool signal_fence) {
+	struct vulkan_copy_engine *engine = &dev->copy;
+	if (vkEndCommandBuffer(slot->cb) != VK_SUCCESS) {
+		errno = EIO;
+		return 0;
+	}
+
+	uint64_t point = engine->last_point + 1;
+	// The value for the binary semaphore is ignored
+	VkSemaphore signal_sems[2] = { engine->timeline, slot->fence };
+	uint64_t signal_values[2] = { point, 0 };
+	uint32_t signal_count = signal_fence ? 2 : 1;
+	VkPipelineStageFlags wait_stages[VULKAN_COPY_MAX_ACCESSES];
+	uint64_t wait_values[VULKAN_COPY_MAX_ACCESSES] = {0};
+	for (uint32_t idx = 0; idx < wait_count; idx++) {
+		wait_stages[idx] = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+	}
+	VkTimelineSemaphoreSubmitInfo timeline_info = {
+		.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+		.waitSemaphoreValueCount = wait_count,
+		.pWaitSemaphoreValues = wait_values,
+		.signalSemaphoreValueCount = signal_count,
+		.pSignalSemaphoreValues = signal_values,
+	};
+	VkSubmitInfo submit_info = {
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+		.pNext = &timeline_info,
+		.waitSemaphoreCount = wait_count,
+		.pWaitSemaphores = slot->waits,
+		.pWaitDstStageMask = wait_stages,
+		.commandBufferCount = 1,
+		.pCommandBuffers = &slot->cb,
+		.signalSemaphoreCount = signal_count,
+		.pSignalSemaphores = signal_sems,
+	};
+	if (vkQueueSubmit(engine->queue, 1, &submit_info, VK_NULL_HANDLE) != VK_SUCCESS) {
+		fprintf(stderr, "Copy submission failed\n");
+		errno = EIO;
+		return 0;
+	}
+	engine->last_point = point;
+	slot->point = point;
+	return point;
+}
+
+// BOs are shared with other devices and processes, so between copies they
+// belong to the foreign queue family in the general layout.
+static void vulkan_copy_acquire(struct gbm_vulkan_device *dev, VkCommandBuffer cb,
+		VkImage image, VkImageLayout layout, VkAccessFlags access) {
+	VkImageMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.dstAccessMask = access,
+		.oldLayout = VK_IMAGE_LAYOUT_GENERAL,
+		.newLayout = layout,
+		.srcQueueFamilyIndex = dev->copy.foreign_queue_family,
+		.dstQueueFamilyIndex = dev->copy.queue_family,
+		.image = image,
+		.subresourceRange = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.levelCount = 1,
+			.layerCount = 1,
+		},
+	};
+	vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		0, 0, NULL, 0, NULL, 1, &barrier);
+}
+
+static void vulkan_copy_release(struct gbm_vulkan_device *dev, VkCommandBuffer cb,
+		VkImage image, VkImageLayout layout, VkAccessFlags access) {
+	VkImageMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = access,
+		.oldLayout = layout,
+		.newLayout = VK_IMAGE_LAYOUT_GENERAL,
+		.srcQueueFamilyIndex = dev->copy.queue_family,
+		.dstQueueFamilyIndex = dev->copy.foreign_queue_family,
+		.image = image,
+		.subresourceRange = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.levelCount = 1,
+			.layerCount = 1,
+		},
+	};
+	vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+		0, 0, NULL, 0, NULL, 1, &barrier);
+}
+
+static bool vulkan_dmabuf_same_buffer(const int *fds, size_t count) {
+	struct stat first_stat;
+	if (fstat(fds[0], &first_stat) != 0) {
+		return false;
+	}
+	for (size_t idx = 1; idx < count; idx++) {
+		struct stat plane_stat;
+		if (fstat(fds[idx], &plane_stat) != 0 || plane_stat.st_ino != first_stat.st_ino) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Imports the single dma-buf behind a BO and binds it to the transfer image
+static bool vulkan_bo_transfer_import(struct gbm_vulkan_device *dev, struct gbm_vulkan_bo *bo) {
+	int fd;
+	if (bo->import) {
+		if (!vulkan_dmabuf_same_buffer(bo->import->fds, bo->plane_cnt)) {
+			fprintf(stderr, "Cannot copy disjoint BO\n");
+			return false;
+		}
+		fd = bo->import->fds[0];
+	} else {
+		fd = gbm_vulkan_bo_export_fd(bo);
+		if (fd == -1) {
+			return false;
+		}
+	}
+
+	VkMemoryFdPropertiesKHR fd_props = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_FD_PROPERTIES_KHR,
+	};
+	if (dev->api.vkGetMemoryFdPropertiesKHR(dev->device,
+			VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT, fd, &fd_props) != VK_SUCCESS) {
+		return false;
+	}
+
+	VkMemoryRequirements mem_reqs = {0};
+	vkGetImageMemoryRequirements(dev->device, bo->transfer->image, &mem_reqs);
+	int mem_type_index = vulkan_find_mem_type(dev->physical_device, 0,
+		mem_reqs.memoryTypeBits & fd_props.memoryTypeBits);
+	if (mem_type_index == -1) {
+		return false;
+	}
+
+	int import_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (import_fd == -1) {
+		return false;
+	}
+	VkMemoryDedicatedAllocateInfo dedicated = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO,
+		.image = bo->transfer->image,
+	};
+	VkImportMemoryFdInfoKHR import_mem = {
+		.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR,
+		.pNext = &dedicated,
+		.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+		.fd = import_fd,
+	};
+	VkMemoryAllocateInfo mem_alloc = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.pNext = &import_mem,
+		.allocationSize = mem_reqs.size,
+		.memoryTypeIndex = mem_type_index,
+	};
+	if (vkAllocateMemory(dev->device, &mem_alloc, NULL, &bo->transfer->memory) != VK_SUCCESS) {
+		bo->transfer->memory = VK_NULL_HANDLE;
+		close(import_fd);
+		return false;
+	}
+	return vkBindImageMemory(dev->device, bo->transfer->image, bo->transfer->memory, 0) == VK_SUCCESS;
+}
+
+// Returns an image for the copy engine, created on first use. BOs created
+// with sampled usage only get an alias with transfer usage on the same
+// memory, all other BOs get their dma-buf imported.
+static struct gbm_vulkan_bo_transfer *gbm_vulkan_bo_get_transfer(struct gbm_vulkan_device *dev,
+		struct gbm_vulkan_bo *bo) {
+	if (bo->transfer) {
+		return bo->transfer;
+	}
+
+	const struct vulkan_format_props *format_props =
+		vulkan_format_props_from_drm(dev, bo->base.v0.format);
+	const struct vulkan_format_modifier_props *mod_props = format_props == NULL ? NULL :
+		vulkan_format_props_find_modifier(format_props, bo->modifier, false);
+	if (mod_props == NULL) {
+		fprintf(stderr, "Format/modifier of BO not usable for copies\n");
+		errno = EINVAL;
+		return NULL;
+	}
+	VkImageUsageFlags usage = vulkan_modifier_transfer_usage(mod_props);
+	if (dev->has_host_copy && mod_props->host_copy) {
+		usage |= VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT;
+	}
+	if (usage == 0) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	VkSubresourceLayout plane_layouts[GBM_MAX_PLANES] = {0};
+	for (size_t idx = 0; idx < bo->plane_cnt; idx++) {
+		plane_layouts[idx].offset = bo->offsets[idx];
+		plane_layouts[idx].rowPitch = bo->strides[idx];
+	}
+	VkImageDrmFormatModifierExplicitCreateInfoEXT explicit_mod = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_EXPLICIT_CREATE_INFO_EXT,
+		.drmFormatModifier = bo->modifier,
+		.drmFormatModifierPlaneCount = bo->plane_cnt,
+		.pPlaneLayouts = plane_layouts,
+	};
+	VkExternalMemoryImageCreateInfo ext_mem = {
+		.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
+		.pNext = &explicit_mod,
+		.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+	};
+	VkImageCreateInfo img_create = vulkan_bo_image_info(bo, format_props, &ext_mem);
+	img_create.usage = usage;
+
+	struct gbm_vulkan_bo_transfer *transfer = calloc(1, sizeof(*transfer));
+	if (transfer == NULL) {
+		return NULL;
+	}
+	transfer->usage = usage;
+	if (vkCreateImage(dev->device, &img_create, NULL, &transfer->image) != VK_SUCCESS) {
+		fprintf(stderr, "Could not create transfer image\n");
+		free(transfer);
+		errno = ENOTSUP;
+		return NULL;
+	}
+	bo->transfer = transfer;
+
+	bool bound;
+	if (bo->memory) {
+		bound = vkBindImageMemory(dev->device, transfer->image, bo->memory, 0) == VK_SUCCESS;
+	} else {
+		bound = vulkan_bo_transfer_import(dev, bo);
+	}
+	if (!bound) {
+		fprintf(stderr, "Could not bind transfer image\n");
+		vkDestroyImage(dev->device, transfer->image, NULL);
+		if (transfer->memory) {
+			vkFreeMemory(dev->device, transfer->memory, NULL);
+		}
+		free(transfer);
+		bo->transfer = NULL;
+		errno = EIO;
+		return NULL;
+	}
+
+	// Host copies use the image in the general layout, like the copy
+	// engine does between copies. Host copy is limited to modifiers
+	// without aux planes, so leaving the undefined layout keeps the
+	// contents.
+	if (usage & VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT) {
+		VkHostImageLayoutTransitionInfoEXT transition = {
+			.sType = VK_STRUCTURE_TYPE_HOST_IMAGE_LAYOUT_TRANSITION_INFO_EXT,
+			.image = transfer->image,
+			.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+			.newLayout = VK_IMAGE_LAYOUT_GENERAL,
+			.subresourceRange = {
+				.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+				.levelCount = 1,
+				.layerCount = 1,
+			},
+		};
+		if (dev->api.vkTransitionImageLayoutEXT(dev->device, 1, &transition) != VK_SUCCESS) {
+			fprintf(stderr, "Could not transition transfer image, host copies disabled for BO\n");
+			transfer->usage &= ~VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT;
+		}
+	}
+	return transfer;
+}
+
+// Bytes per pixel for copies, 0 for formats the copy engine cannot handle
+static uint32_t vulkan_copy_bpp(const struct gbm_vulkan_bo *bo) {
+	const struct pixel_format_info *info = drm_get_pixel_format_info(bo->base.v0.format);
+	if (info == NULL || info->block_width > 1 || info->block_height > 1) {
+		return 0;
+	}
+	return info->bytes_per_block;
+}
+
+static bool vulkan_copy_region_valid(const struct gbm_vulkan_bo *bo,
+		uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+	return width > 0 && height > 0 &&
+		(uint64_t)x + width <= bo->base.v0.width && (uint64_t)y + height <= bo->base.v0.height;
+}
+
+static void copy_rows(char *dst, size_t dst_stride, const char *src, size_t src_stride,
+		size_t row_size, uint32_t rows) {
+	if (dst_stride == row_size && src_stride == row_size) {
+		memcpy(dst, src, row_size * rows);
+		return;
+	}
+	for (uint32_t row = 0; row < rows; row++) {
+		memcpy(dst + row * dst_stride, src + row * src_stride, row_size);
+	}
+}
+
+// Records a copy of a BO region into a slot's staging buffer, packed
+// tightly, and returns the slot for the caller to submit
+static struct vulkan_copy_slot *vulkan_copy_record_readback(struct gbm_vulkan_device *dev,
+		struct gbm_vulkan_bo *bo, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+	uint32_t bpp = vulkan_copy_bpp(bo);
+	if (bpp == 0 || !vulkan_copy_region_valid(bo, x, y, width, height)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct gbm_vulkan_bo_transfer *transfer = gbm_vulkan_bo_get_transfer(dev, bo);
+	if (transfer == NULL) {
+		return NULL;
+	}
+	if (!(transfer->usage & VK_IMAGE_USAGE_TRANSFER_SRC_BIT)) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	struct vulkan_copy_slot *slot = vulkan_copy_begin(dev, (VkDeviceSize)width * bpp * height);
+	if (slot == NULL) {
+		return NULL;
+	}
+
+	vulkan_copy_acquire(dev, slot->cb, transfer->image,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_ACCESS_TRANSFER_READ_BIT);
+	VkBufferImageCopy region = {
+		.imageSubresource = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.layerCount = 1,
+		},
+		.imageOffset = { .x = x, .y = y },
+		.imageExtent = { .width = width, .height = height, .depth = 1 },
+	};
+	vkCmdCopyImageToBuffer(slot->cb, transfer->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		slot->staging.buffer, 1, &region);
+	vulkan_copy_release(dev, slot->cb, transfer->image,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_ACCESS_TRANSFER_READ_BIT);
+	VkMemoryBarrier host_barrier = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+	};
+	vkCmdPipelineBarrier(slot->cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+		0, 1, &host_barrier, 0, NULL, 0, NULL);
+	return slot;
+}
+
+// Collects the distinct dma-bufs behind a BO, as the planes of an imported
+// BO may or may not share one
+static size_t gbm_vulkan_bo_dmabufs(struct gbm_vulkan_bo *bo, int fds[static GBM_MAX_PLANES]) {
+	if (!bo->import) {
+		int fd = gbm_vulkan_bo_export_fd(bo);
+		if (fd == -1) {
+			return 0;
+		}
+		fds[0] = fd;
+		return 1;
+	}
+
+	size_t count = 0;
+	for (size_t idx = 0; idx < bo->plane_cnt; idx++) {
+		int fd = bo->import->fds[idx];
+		bool seen = false;
+		for (size_t prev = 0; prev < count && !seen; prev++) {
+			seen = fds[prev] == fd || vulkan_dmabuf_same_buffer((int[]){ fds[prev], fd }, 2);
+		}
+		if (!seen) {
+			fds[count++] = fd;
+		}
+	}
+	return count;
+}
+
+// Snapshots the fences on the dma-bufs of a BO as one sync_file, for the
+// DMA_BUF_SYNC_* access in sync_flags
+static int vulkan_bo_export_sync_file(struct gbm_vulkan_bo *bo, uint32_t sync_flags) {
+	int fds[GBM_MAX_PLANES];
+	size_t fd_count = gbm_vulkan_bo_dmabufs(bo, fds);
+	if (fd_count == 0) {
+		return -1;
+	}
+
+	int sync_file = -1;
+	for (size_t idx = 0; idx < fd_count; idx++) {
+		struct dma_buf_export_sync_file export_sync = {
+			.flags = sync_flags,
+			.fd = -1,
+		};
+		if (drmIoctl(fds[idx], DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &export_sync) != 0) {
+			goto error;
+		}
+		if (sync_file == -1) {
+			sync_file = export_sync.fd;
+			continue;
+		}
+
+		struct sync_merge_data merge = {
+			.name = "vulkan_gbm",
+			.fd2 = export_sync.fd,
+		};
+		int ret = drmIoctl(sync_file, SYNC_IOC_MERGE, &merge);
+		close(export_sync.fd);
+		if (ret != 0) {
+			fprintf(stderr, "Could not merge sync_files: %s\n", strerror(errno));
+			goto error;
+		}
+		close(sync_file);
+		sync_file = merge.fence;
+	}
+	return sync_file;
+
+error:
+	if (sync_file != -1) {
+		int saved_errno = errno;
+		close(sync_file);
+		errno = saved_errno;
+	}
+	return -1;
+}
+
+// Adds sync_file to the fences on the dma-bufs of a BO
+static bool vulkan_bo_import_sync_file(struct gbm_vulkan_bo *bo, int sync_file, uint32_t sync_flags) {
+	int fds[GBM_MAX_PLANES];
+	size_t fd_count = gbm_vulkan_bo_dmabufs(bo, fds);
+	if (fd_count == 0) {
+		return false;
+	}
+	for (size_t idx = 0; idx < fd_count; idx++) {
+		struct dma_buf_import_sync_file import_sync = {
+			.flags = sync_flags,
+			.fd = sync_file,
+		};
+		if (drmIoctl(fds[idx], DMA_BUF_IOCTL_IMPORT_SYNC_FILE, &import_sync) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Waits for the implicit fences on the dma-bufs of a BO, before the CPU
+// reads (pending writes only) or writes (all pending access) it
+static bool gbm_vulkan_bo_wait_implicit(struct gbm_vulkan_bo *bo, bool write) {
+	int fds[GBM_MAX_PLANES];
+	size_t fd_count = gbm_vulkan_bo_dmabufs(bo, fds);
+	if (fd_count == 0) {
+		return false;
+	}
+	for (size_t idx = 0; idx < fd_count; idx++) {
+		struct pollfd pfd = {
+			.fd = fds[idx],
+			.events = write ? POLLOUT : POLLIN,
+		};
+		int ret;
+		do {
+			ret = poll(&pfd, 1, -1);
+		} while (ret == -1 && (errno == EINTR || errno == EAGAIN));
+		if (ret == -1) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Called after vulkan_copy_begin, which has waited for the previous
+// submission of the slot
+static bool vulkan_copy_slot_ensure_fence(struct gbm_vulkan_device *dev, struct vulkan_copy_slot *slot) {
+	if (slot->fence && slot->fence_stale) {
+		vkDestroySemaphore(dev->device, slot->fence, NULL);
+		slot->fence = VK_NULL_HANDLE;
+	}
+	slot->fence_stale = false;
+	if (slot->fence) {
+		return true;
+	}
+	VkExportSemaphoreCreateInfo export_info = {
+		.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO,
+		.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT,
+	};
+	VkSemaphoreCreateInfo sem_info = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+		.pNext = &export_info,
+	};
+	if (vkCreateSemaphore(dev->device, &sem_info, NULL, &slot->fence) != VK_SUCCESS) {
+		slot->fence = VK_NULL_HANDLE;
+		return false;
+	}
+	return true;
+}
+
+// A BO that a copy reads or writes
+struct vulkan_copy_access {
+	struct gbm_vulkan_bo *bo;
+	bool write;
+};
+
+// Makes the next submission of a slot wait for the implicit fences of a BO,
+// by importing them into one of the slot's wait semaphores. Returns false
+// when they cannot be imported, for the caller to wait on the CPU instead.
+static bool vulkan_copy_import_implicit(struct gbm_vulkan_device *dev,
+		struct vulkan_copy_slot *slot, uint32_t idx, const struct vulkan_copy_access *access) {
+	struct vulkan_copy_engine *engine = &dev->copy;
+	if (!engine->has_sync_fd || !engine->dmabuf_sync_file) {
+		return false;
+	}
+	int sync_file = vulkan_bo_export_sync_file(access->bo,
+		access->write ? DMA_BUF_SYNC_WRITE : DMA_BUF_SYNC_READ);
+	if (sync_file == -1) {
+		if (errno == ENOTTY) {
+			engine->dmabuf_sync_file = false;
+		}
+		return false;
+	}
 
-	VkImageDrmFormatModifierPropertiesEXT img_mod_props = {
-		.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_PROPERTIES_EXT,
+	if (slot->waits[idx] == VK_NULL_HANDLE) {
+		VkSemaphoreCreateInfo sem_info = {
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+		};
+		if (vkCreateSemaphore(dev->device, &sem_info, NULL, &slot->waits[idx]) != VK_SUCCESS) {
+			slot->waits[idx] = VK_NULL_HANDLE;
+			close(sync_file);
+			return false;
+		}
+	}
+	// The semaphore takes ownership of the sync_file, and reverts to its
+	// own payload once the submission has waited for it
+	VkImportSemaphoreFdInfoKHR import_info = {
+		.sType = VK_STRUCTURE_TYPE_IMPORT_SEMAPHORE_FD_INFO_KHR,
+		.semaphore = slot->waits[idx],
+		.flags = VK_SEMAPHORE_IMPORT_TEMPORARY_BIT,
+		.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT,
+		.fd = sync_file,
 	};
-	if (vulkan->api.vkGetImageDrmFormatModifierPropertiesEXT(
-				vulkan->device, bo->image, &img_mod_props) != VK_SUCCESS) {
-		gbm_vulkan_bo_destroy(&bo->base);
-		return NULL;
+	if (dev->api.vkImportSemaphoreFdKHR(dev->device, &import_info) != VK_SUCCESS) {
+		close(sync_file);
+		return false;
 	}
+	return true;
+}
 
-	bo->modifier = img_mod_props.drmFormatModifier;
-	const struct vulkan_format_modifier_props *mod_props =
-		vulkan_format_props_find_modifier(format_props, img_mod_props.drmFormatModifier, usage & GBM_BO_USE_RENDERING);
-	assert(mod_props != NULL);
-	bo->plane_cnt = mod_props->props.drmFormatModifierPlaneCount;
+// Submits a copy between BOs shared through dma-bufs, synchronized with
+// their other users through the implicit fences. The submission waits for
+// the fences already on the dma-bufs, and its completion is added to them
+// as a read or write fence. Without sync_file support in the driver or the
+// kernel, the CPU waits for the fences instead, and the completion is only
+// known to our own timeline.
+//
+// Returns the timeline point like vulkan_copy_submit. When fence_fd is set,
+// it receives a sync_file of the completion, or -1 if none can be exported.
+static uint64_t vulkan_copy_submit_implicit(struct gbm_vulkan_device *dev,
+		struct vulkan_copy_slot *slot, const struct vulkan_copy_access *accesses,
+		uint32_t access_count, int *fence_fd) {
+	struct vulkan_copy_engine *engine = &dev->copy;
+	assert(access_count <= VULKAN_COPY_MAX_ACCESSES);
+	if (fence_fd != NULL) {
+		*fence_fd = -1;
+	}
 
-	for (size_t idx = 0; idx < bo->plane_cnt; idx++) {
-		const VkImageAspectFlagBits plane_aspects[] = {
-			VK_IMAGE_ASPECT_MEMORY_PLANE_0_BIT_EXT,
-			VK_IMAGE_ASPECT_MEMORY_PLANE_1_BIT_EXT,
-			VK_IMAGE_ASPECT_MEMORY_PLANE_2_BIT_EXT,
-			VK_IMAGE_ASPECT_MEMORY_PLANE_3_BIT_EXT,
-		};
+	uint32_t wait_count = 0;
+	for (uint32_t idx = 0; idx < access_count; idx++) {
+		if (vulkan_copy_import_implicit(dev, slot, wait_count, &accesses[idx])) {
+			wait_count++;
+		} else if (!gbm_vulkan_bo_wait_implicit(accesses[idx].bo, accesses[idx].write)) {
+			return 0;
+		}
+	}
 
-		VkImageSubresource img_subres = {
-			.aspectMask = plane_aspects[idx],
-		};
-		VkSubresourceLayout subres_layout = {0};
-		vkGetImageSubresourceLayout(vulkan->device, bo->image, &img_subres, &subres_layout);
-		bo->strides[idx] = subres_layout.rowPitch;
-		bo->offsets[idx] = subres_layout.offset;
+	bool attach = engine->has_sync_fd && engine->dmabuf_sync_file && access_count > 0;
+	bool signal_fence = (attach || fence_fd != NULL) && engine->has_sync_fd &&
+		vulkan_copy_slot_ensure_fence(dev, slot);
+	uint64_t point = vulkan_copy_submit(dev, slot, wait_count, signal_fence);
+	if (point == 0 || !signal_fence) {
+		return point;
 	}
 
-	return &bo->base;
+	int sync_file;
+	VkSemaphoreGetFdInfoKHR get_fd = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR,
+		.semaphore = slot->fence,
+		.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT,
+	};
+	if (dev->api.vkGetSemaphoreFdKHR(dev->device, &get_fd, &sync_file) != VK_SUCCESS) {
+		// Exporting would have reset the semaphore, which now stays
+		// signaled and cannot be signaled again
+		fprintf(stderr, "Could not export copy fence\n");
+		slot->fence_stale = true;
+		return point;
+	}
+	for (uint32_t idx = 0; attach && idx < access_count; idx++) {
+		// Failing to attach the fence is not fatal, the BO is then
+		// only protected by our own timeline
+		vulkan_bo_import_sync_file(accesses[idx].bo, sync_file,
+			accesses[idx].write ? DMA_BUF_SYNC_WRITE : DMA_BUF_SYNC_READ);
+	}
+	if (fence_fd != NULL) {
+		*fence_fd = sync_file;
+	} else {
+		close(sync_file);
+	}
+	return point;
 }
 
-static int gbm_vulkan_bo_get_fd(struct gbm_bo *_bo) {
-	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
-	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
-	int fd;
-
-	if (bo->image == NULL) {
-		fprintf(stderr, "Atempt to get fd for plane without image\n");
+// VK_EXT_host_image_copy lets the driver tile and detile on the CPU, with
+// no submission or staging memory involved
+static bool vulkan_host_copy_bo_to_host(struct gbm_vulkan_device *dev, struct gbm_vulkan_bo *bo,
+		struct gbm_vulkan_bo_transfer *transfer, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height, void *dst, uint32_t dst_stride) {
+	uint32_t bpp = vulkan_copy_bpp(bo);
+	if (bpp == 0 || dst_stride % bpp != 0 || !vulkan_copy_region_valid(bo, x, y, width, height)) {
 		errno = EINVAL;
-		return -1;
+		return false;
 	}
-	if (bo->plane_cnt != 1) {
-		fprintf(stderr, "Atempt to get single fd for multi-planar image\n");
+	if (!gbm_vulkan_bo_wait_implicit(bo, false)) {
+		return false;
+	}
+
+	VkImageToMemoryCopyEXT region = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_TO_MEMORY_COPY_EXT,
+		.pHostPointer = dst,
+		.memoryRowLength = dst_stride / bpp,
+		.imageSubresource = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.layerCount = 1,
+		},
+		.imageOffset = { .x = x, .y = y },
+		.imageExtent = { .width = width, .height = height, .depth = 1 },
+	};
+	VkCopyImageToMemoryInfoEXT copy_info = {
+		.sType = VK_STRUCTURE_TYPE_COPY_IMAGE_TO_MEMORY_INFO_EXT,
+		.srcImage = transfer->image,
+		.srcImageLayout = VK_IMAGE_LAYOUT_GENERAL,
+		.regionCount = 1,
+		.pRegions = &region,
+	};
+	if (dev->api.vkCopyImageToMemoryEXT(dev->device, &copy_info) != VK_SUCCESS) {
+		fprintf(stderr, "Host image copy from BO failed\n");
+		errno = EIO;
+		return false;
+	}
+	return true;
+}
+
+static bool vulkan_host_copy_host_to_bo(struct gbm_vulkan_device *dev, struct gbm_vulkan_bo *bo,
+		struct gbm_vulkan_bo_transfer *transfer, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height, const void *src, uint32_t src_stride) {
+	uint32_t bpp = vulkan_copy_bpp(bo);
+	if (bpp == 0 || src_stride % bpp != 0 || !vulkan_copy_region_valid(bo, x, y, width, height)) {
 		errno = EINVAL;
-		return -1;
+		return false;
 	}
-	if (bo->import) {
-		return bo->import->fds[0];
+	// Asynchronous readbacks of our own do not show up as implicit fences
+	if (!vulkan_copy_wait(dev, transfer->point) || !gbm_vulkan_bo_wait_implicit(bo, true)) {
+		return false;
 	}
 
-	VkMemoryGetFdInfoKHR mem_get_fd = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR,
-		.memory = bo->memory,
-		.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+	VkMemoryToImageCopyEXT region = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_TO_IMAGE_COPY_EXT,
+		.pHostPointer = src,
+		.memoryRowLength = src_stride / bpp,
+		.imageSubresource = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.layerCount = 1,
+		},
+		.imageOffset = { .x = x, .y = y },
+		.imageExtent = { .width = width, .height = height, .depth = 1 },
 	};
-	if (dev->api.vkGetMemoryFdKHR(dev->device, &mem_get_fd, &fd) != VK_SUCCESS) {
-		return -1;
+	VkCopyMemoryToImageInfoEXT copy_info = {
+		.sType = VK_STRUCTURE_TYPE_COPY_MEMORY_TO_IMAGE_INFO_EXT,
+		.dstImage = transfer->image,
+		.dstImageLayout = VK_IMAGE_LAYOUT_GENERAL,
+		.regionCount = 1,
+		.pRegions = &region,
+	};
+	if (dev->api.vkCopyMemoryToImageEXT(dev->device, &copy_info) != VK_SUCCESS) {
+		fprintf(stderr, "Host image copy to BO failed\n");
+		errno = EIO;
+		return false;
 	}
-
-	return fd;
+	return true;
 }
 
-static int gbm_vulkan_bo_get_plane_fd(struct gbm_bo *_bo, int plane) {
-	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
-
-	if ((size_t)plane >= bo->plane_cnt) {
-		fprintf(stderr, "Atempt to get fd for invalid plane\n");
-		return -1;
+// Maps the dma-buf of a BO for the CPU, on first use
+static char *gbm_vulkan_bo_cpu_map(struct gbm_vulkan_bo *bo, int *fd_out) {
+	int fd = bo->import ? bo->import->fds[0] : gbm_vulkan_bo_export_fd(bo);
+	if (fd == -1) {
+		return NULL;
 	}
-	if (bo->import) {
-		return bo->import->fds[plane];
+	*fd_out = fd;
+	if (bo->cpu_map != NULL) {
+		return bo->cpu_map;
 	}
 
-	// TODO: Cache and dup?
-	return gbm_vulkan_bo_get_fd(_bo);
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size <= 0) {
+		return NULL;
+	}
+	void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		// Not all exporters allow mapping, e.g. for VRAM
+		return NULL;
+	}
+	bo->cpu_map = addr;
+	bo->cpu_map_size = size;
+	return bo->cpu_map;
 }
 
-static uint64_t gbm_vulkan_bo_get_modifier(struct gbm_bo *_bo) {
-	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
-	if (!bo->image && !bo->import) {
-		return DRM_FORMAT_MOD_LINEAR;
-	}
-	return bo->modifier;
+static bool vulkan_sw_tile_supported(const struct gbm_vulkan_bo *bo) {
+	const struct vulkan_tile_layout *layout = vulkan_get_tile_layout(bo->modifier);
+	return layout != NULL && bo->plane_cnt == 1 && vulkan_copy_bpp(bo) != 0 &&
+		bo->strides[0] > 0 && bo->strides[0] % layout->tile_width == 0;
 }
 
-static union gbm_bo_handle gbm_vulkan_bo_get_handle_for_plane(struct gbm_bo *_bo, int plane) {
-	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
-	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
-	if ((size_t)plane >= bo->plane_cnt) {
-		return (union gbm_bo_handle){0};
+// Copies a region between a tiled BO and host memory on the CPU, without
+// needing a queue. Returns false with errno set if the dma-buf cannot be
+// mapped, in which case the caller falls back to a GPU copy.
+static bool vulkan_sw_tile_copy(struct gbm_vulkan_bo *bo, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height, void *host, uint32_t host_stride, bool detile) {
+	uint32_t bpp = vulkan_copy_bpp(bo);
+	if (!vulkan_copy_region_valid(bo, x, y, width, height)) {
+		errno = EINVAL;
+		return false;
 	}
-	if (bo->import) {
-		union gbm_bo_handle ret;
+	const struct vulkan_tile_layout *layout = vulkan_get_tile_layout(bo->modifier);
+	uint32_t stride = bo->strides[0];
+	size_t rows = (bo->base.v0.height + layout->tile_height - 1) / layout->tile_height * layout->tile_height;
 
-		if (drmPrimeFDToHandle(dev->base.v0.fd, bo->import->fds[plane], &ret.u32) != 0) {
-			fprintf(stderr, "Could not create handle from PRIME FD\n");
-			return (union gbm_bo_handle){0};
-		}
-		return ret;
+	int fd;
+	char *map = gbm_vulkan_bo_cpu_map(bo, &fd);
+	if (map == NULL || (size_t)bo->offsets[0] + stride * rows > bo->cpu_map_size) {
+		errno = ENOTSUP;
+		return false;
 	}
 
-	int fd = gbm_vulkan_bo_get_fd(_bo);
-	if (fd == -1) {
-		return (union gbm_bo_handle){0};
+	uint64_t access = detile ? DMA_BUF_SYNC_READ : DMA_BUF_SYNC_WRITE;
+	struct dma_buf_sync sync = { .flags = DMA_BUF_SYNC_START | access };
+	if (drmIoctl(fd, DMA_BUF_IOCTL_SYNC, &sync) != 0) {
+		return false;
 	}
+	vulkan_tile_copy(layout, map + bo->offsets[0], stride, host, host_stride,
+		x * bpp, y, width * bpp, height, detile);
+	sync.flags = DMA_BUF_SYNC_END | access;
+	drmIoctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+	return true;
+}
 
-	union gbm_bo_handle ret;
-	if (drmPrimeFDToHandle(dev->base.v0.fd, fd, &ret.u32) != 0) {
-		fprintf(stderr, "Could not create handle from PRIME FD\n");
-		return (union gbm_bo_handle){0};
+// Copies a region of a BO into host memory, blocking until it is done
+static bool vulkan_copy_bo_to_host_locked(struct gbm_vulkan_device *dev, struct gbm_vulkan_bo *bo,
+		uint32_t x, uint32_t y, uint32_t width, uint32_t height, void *dst, uint32_t dst_stride) {
+	struct gbm_vulkan_bo_transfer *transfer = gbm_vulkan_bo_get_transfer(dev, bo);
+	if (transfer != NULL && (transfer->usage & VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT)) {
+		return vulkan_host_copy_bo_to_host(dev, bo, transfer, x, y, width, height, dst, dst_stride);
+	}
+	if (vulkan_sw_tile_supported(bo) &&
+			vulkan_sw_tile_copy(bo, x, y, width, height, dst, dst_stride, true)) {
+		return true;
 	}
 
-	return ret;
+	struct vulkan_copy_slot *slot = vulkan_copy_record_readback(dev, bo, x, y, width, height);
+	if (slot == NULL) {
+		return false;
+	}
+	struct vulkan_copy_access access = { .bo = bo, .write = false };
+	uint64_t point = vulkan_copy_submit_implicit(dev, slot, &access, 1, NULL);
+	if (point == 0) {
+		return false;
+	}
+	// The BO must outlive the copy, see gbm_vulkan_bo_destroy
+	bo->transfer->point = point;
+	if (!vulkan_copy_wait(dev, point)) {
+		return false;
+	}
+	size_t row_size = (size_t)width * vulkan_copy_bpp(bo);
+	copy_rows(dst, dst_stride, slot->staging.map, row_size, row_size, height);
+	return true;
 }
 
-static uint32_t gbm_vulkan_bo_get_offset(struct gbm_bo *_bo, int plane) {
-	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
-	if ((size_t)plane >= bo->plane_cnt) {
+// Copies host memory into a region of a BO, blocking until it is done so
+// that the contents are in place before anyone else gets to use the BO
+static bool vulkan_copy_host_to_bo_locked(struct gbm_vulkan_device *dev, struct gbm_vulkan_bo *bo,
+		uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+		const void *src, uint32_t src_stride) {
+	struct gbm_vulkan_bo_transfer *transfer = gbm_vulkan_bo_get_transfer(dev, bo);
+	if (transfer != NULL && (transfer->usage & VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT)) {
+		return vulkan_host_copy_host_to_bo(dev, bo, transfer, x, y, width, height, src, src_stride);
+	}
+	if (vulkan_sw_tile_supported(bo) && (transfer == NULL || vulkan_copy_wait(dev, transfer->point)) &&
+			vulkan_sw_tile_copy(bo, x, y, width, height, (void *)src, src_stride, false)) {
+		return true;
+	}
+	if (transfer == NULL) {
+		return false;
+	}
+	uint32_t bpp = vulkan_copy_bpp(bo);
+	if (bpp == 0 || !vulkan_copy_region_valid(bo, x, y, width, height)) {
 		errno = EINVAL;
-		return 0;
+		return false;
 	}
-	return bo->offsets[plane];
+	if (!(transfer->usage & VK_IMAGE_USAGE_TRANSFER_DST_BIT)) {
+		errno = ENOTSUP;
+		return false;
+	}
+
+	size_t row_size = (size_t)width * bpp;
+	struct vulkan_copy_slot *slot = vulkan_copy_begin(dev, row_size * height);
+	if (slot == NULL) {
+		return false;
+	}
+	// Host writes before the submission are visible to it without a barrier
+	copy_rows(slot->staging.map, row_size, src, src_stride, row_size, height);
+
+	vulkan_copy_acquire(dev, slot->cb, transfer->image,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT);
+	VkBufferImageCopy region = {
+		.imageSubresource = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.layerCount = 1,
+		},
+		.imageOffset = { .x = x, .y = y },
+		.imageExtent = { .width = width, .height = height, .depth = 1 },
+	};
+	vkCmdCopyBufferToImage(slot->cb, slot->staging.buffer, transfer->image,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+	vulkan_copy_release(dev, slot->cb, transfer->image,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT);
+
+	struct vulkan_copy_access access = { .bo = bo, .write = true };
+	uint64_t point = vulkan_copy_submit_implicit(dev, slot, &access, 1, NULL);
+	return point != 0 && vulkan_copy_wait(dev, point);
 }
 
-static uint32_t gbm_vulkan_bo_get_stride(struct gbm_bo *_bo, int plane) {
-	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
-	if ((size_t)plane >= bo->plane_cnt) {
+// Copies a region between two BOs of the same format, blocking until it is done
+static bool vulkan_copy_bo_to_bo_locked(struct gbm_vulkan_device *dev,
+		struct gbm_vulkan_bo *src, uint32_t src_x, uint32_t src_y,
+		struct gbm_vulkan_bo *dst, uint32_t dst_x, uint32_t dst_y,
+		uint32_t width, uint32_t height) {
+	if (src == dst || src->base.v0.format != dst->base.v0.format ||
+			!vulkan_copy_region_valid(src, src_x, src_y, width, height) ||
+			!vulkan_copy_region_valid(dst, dst_x, dst_y, width, height)) {
 		errno = EINVAL;
-		return 0;
+		return false;
 	}
-	return bo->strides[plane];
+	struct gbm_vulkan_bo_transfer *src_transfer = gbm_vulkan_bo_get_transfer(dev, src);
+	struct gbm_vulkan_bo_transfer *dst_transfer = gbm_vulkan_bo_get_transfer(dev, dst);
+	if (src_transfer == NULL || dst_transfer == NULL) {
+		return false;
+	}
+	if (!(src_transfer->usage & VK_IMAGE_USAGE_TRANSFER_SRC_BIT) ||
+			!(dst_transfer->usage & VK_IMAGE_USAGE_TRANSFER_DST_BIT)) {
+		errno = ENOTSUP;
+		return false;
+	}
+
+	struct vulkan_copy_slot *slot = vulkan_copy_begin(dev, 0);
+	if (slot == NULL) {
+		return false;
+	}
+
+	vulkan_copy_acquire(dev, slot->cb, src_transfer->image,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_ACCESS_TRANSFER_READ_BIT);
+	vulkan_copy_acquire(dev, slot->cb, dst_transfer->image,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT);
+	VkImageCopy region = {
+		.srcSubresource = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.layerCount = 1,
+		},
+		.srcOffset = { .x = src_x, .y = src_y },
+		.dstSubresource = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.layerCount = 1,
+		},
+		.dstOffset = { .x = dst_x, .y = dst_y },
+		.extent = { .width = width, .height = height, .depth = 1 },
+	};
+	vkCmdCopyImage(slot->cb, src_transfer->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		dst_transfer->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+	vulkan_copy_release(dev, slot->cb, src_transfer->image,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_ACCESS_TRANSFER_READ_BIT);
+	vulkan_copy_release(dev, slot->cb, dst_transfer->image,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT);
+
+	struct vulkan_copy_access accesses[] = {
+		{ .bo = src, .write = false },
+		{ .bo = dst, .write = true },
+	};
+	uint64_t point = vulkan_copy_submit_implicit(dev, slot, accesses, ARRAY_SIZE(accesses), NULL);
+	return point != 0 && vulkan_copy_wait(dev, point);
 }
 
-static int gbm_vulkan_bo_get_planes(struct gbm_bo *_bo) {
-	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
-	return bo->plane_cnt;
+static bool vulkan_copy_bo_to_host(struct gbm_vulkan_device *dev, struct gbm_vulkan_bo *bo,
+		uint32_t x, uint32_t y, uint32_t width, uint32_t height, void *dst, uint32_t dst_stride) {
+	pthread_mutex_lock(&dev->copy_lock);
+	bool ok = vulkan_copy_bo_to_host_locked(dev, bo, x, y, width, height, dst, dst_stride);
+	pthread_mutex_unlock(&dev->copy_lock);
+	return ok;
 }
 
-static int gbm_vulkan_get_format_modifier_plane_count(struct gbm_device *gbm,
-		uint32_t format, uint64_t modifier) {
-	struct gbm_vulkan_device *dev = gbm_vulkan_device(gbm);
-	struct vulkan_format_props *format_props = vulkan_format_props_from_drm(dev, format);
+static bool vulkan_copy_host_to_bo(struct gbm_vulkan_device *dev, struct gbm_vulkan_bo *bo,
+		uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+		const void *src, uint32_t src_stride) {
+	pthread_mutex_lock(&dev->copy_lock);
+	bool ok = vulkan_copy_host_to_bo_locked(dev, bo, x, y, width, height, src, src_stride);
+	pthread_mutex_unlock(&dev->copy_lock);
+	return ok;
+}
 
-	const struct vulkan_format_modifier_props *mod_props =
-		vulkan_format_props_find_modifier(format_props, modifier, false);
-	if (mod_props == NULL) {
-		errno = EINVAL;
-		return 0;
+static bool vulkan_copy_bo_to_bo(struct gbm_vulkan_device *dev,
+		struct gbm_vulkan_bo *src, uint32_t src_x, uint32_t src_y,
+		struct gbm_vulkan_bo *dst, uint32_t dst_x, uint32_t dst_y, uint32_t width, uint32_t height) {
+	pthread_mutex_lock(&dev->copy_lock);
+	bool ok = vulkan_copy_bo_to_bo_locked(dev, src, src_x, src_y, dst, dst_x, dst_y, width, height);
+	pthread_mutex_unlock(&dev->copy_lock);
+	return ok;
+}
+
+static void vulkan_copy_engine_finish(struct gbm_vulkan_device *dev) {
+	struct vulkan_copy_engine *engine = &dev->copy;
+	if (engine->last_point > 0) {
+		vulkan_copy_wait(dev, engine->last_point);
 	}
-	assert(mod_props != NULL);
-	return mod_props->props.drmFormatModifierPlaneCount;
+	for (size_t idx = 0; idx < VULKAN_COPY_SLOT_COUNT; idx++) {
+		vulkan_staging_finish(dev, &engine->slots[idx].staging);
+		if (engine->slots[idx].fence) {
+			vkDestroySemaphore(dev->device, engine->slots[idx].fence, NULL);
+		}
+		for (size_t wait = 0; wait < VULKAN_COPY_MAX_ACCESSES; wait++) {
+			if (engine->slots[idx].waits[wait]) {
+				vkDestroySemaphore(dev->device, engine->slots[idx].waits[wait], NULL);
+			}
+		}
+	}
+	if (engine->pool) {
+		// Frees the command buffers along with it
+		vkDestroyCommandPool(dev->device, engine->pool, NULL);
+	}
+	if (engine->timeline) {
+		vkDestroySemaphore(dev->device, engine->timeline, NULL);
+	}
+	*engine = (struct vulkan_copy_engine){0};
 }
 
-static int gbm_vulkan_is_format_supported(struct gbm_device *gbm, uint32_t format, uint32_t usage) {
-	struct gbm_vulkan_device *dev = gbm_vulkan_device(gbm);
-	if (usage & (GBM_BO_USE_WRITE | GBM_BO_USE_PROTECTED)) {
-		// These usages are not implemented
-		errno = EINVAL;
-		return 0;
+static bool vulkan_copy_engine_init(struct gbm_vulkan_device *dev, uint32_t queue_family,
+		bool has_foreign, bool has_sync_fd) {
+	struct vulkan_copy_engine *engine = &dev->copy;
+	engine->queue_family = queue_family;
+	engine->foreign_queue_family = has_foreign ?
+		VK_QUEUE_FAMILY_FOREIGN_EXT : VK_QUEUE_FAMILY_EXTERNAL;
+	vkGetDeviceQueue(dev->device, queue_family, 0, &engine->queue);
+
+	VkCommandPoolCreateInfo pool_info = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+		.queueFamilyIndex = queue_family,
+	};
+	if (vkCreateCommandPool(dev->device, &pool_info, NULL, &engine->pool) != VK_SUCCESS) {
+		engine->pool = VK_NULL_HANDLE;
+		goto error;
 	}
-	struct vulkan_format_props *format_props = vulkan_format_props_from_drm(dev, format);
-	if (format_props == NULL) {
-		errno = EINVAL;
-		return 0;
+
+	VkCommandBuffer cbs[VULKAN_COPY_SLOT_COUNT];
+	VkCommandBufferAllocateInfo cb_info = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+		.commandPool = engine->pool,
+		.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+		.commandBufferCount = VULKAN_COPY_SLOT_COUNT,
+	};
+	if (vkAllocateCommandBuffers(dev->device, &cb_info, cbs) != VK_SUCCESS) {
+		goto error;
 	}
-	return 1;
+	for (size_t idx = 0; idx < VULKAN_COPY_SLOT_COUNT; idx++) {
+		engine->slots[idx].cb = cbs[idx];
+	}
+
+	VkSemaphoreTypeCreateInfo type_info = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+		.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+		.initialValue = 0,
+	};
+	VkSemaphoreCreateInfo sem_info = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+		.pNext = &type_info,
+	};
+	if (vkCreateSemaphore(dev->device, &sem_info, NULL, &engine->timeline) != VK_SUCCESS) {
+		engine->timeline = VK_NULL_HANDLE;
+		goto error;
+	}
+
+	engine->has_sync_fd = has_sync_fd;
+	engine->dmabuf_sync_file = true;
+	engine->enabled = true;
+	return true;
+
+error:
+	fprintf(stderr, "Could not set up copy engine\n");
+	vulkan_copy_engine_finish(dev);
+	return false;
 }
 
 static int gbm_vulkan_bo_write(struct gbm_bo *_bo, const void *buf, size_t count) {
-	(void)_bo, (void)buf, (void)count;
-	errno = EINVAL;
-	// NOT IMPLEMENTED
-	return -1;
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
+	if (bo->dumb == NULL) {
+		// Tightly packed rows, as written to a cursor. Only whole rows
+		// are copied.
+		uint32_t bpp = vulkan_copy_bpp(bo);
+		if (bpp == 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		size_t row_size = (size_t)bo->base.v0.width * bpp;
+		size_t rows = count / row_size;
+		if (rows > bo->base.v0.height) {
+			rows = bo->base.v0.height;
+		}
+		if (!vulkan_copy_host_to_bo(dev, bo, 0, 0, bo->base.v0.width, rows, buf, row_size)) {
+			return -1;
+		}
+		return 0;
+	}
+	if (count > bo->dumb->size) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(bo->dumb->map, buf, count);
+	return 0;
 }
 
 static bool is_dmabuf_disjoint(struct gbm_import_fd_modifier_data *fd_data) {
@@ -781,21 +4211,109 @@ static bool is_dmabuf_disjoint(struct gbm_import_fd_modifier_data *fd_data) {
 		return true;
 	}
 
-	for (uint32_t i = 1; i < fd_data->num_fds; i++) {
-		struct stat plane_stat;
-		if (fstat(fd_data->fds[i], &plane_stat) != 0) {
-			return true;
-		}
-
-		if (first_stat.st_ino != plane_stat.st_ino) {
-			return true;
-		}
+	for (uint32_t i = 1; i < fd_data->num_fds; i++) {
+		struct stat plane_stat;
+		if (fstat(fd_data->fds[i], &plane_stat) != 0) {
+			return true;
+		}
+
+		if (first_stat.st_ino != plane_stat.st_ino) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Wraps a memfd region in a dma-buf through udmabuf, so that shm clients
+// can be sampled by the GPU straight from the pages they draw into.
+static struct gbm_bo *gbm_vulkan_bo_import_shm(struct gbm_vulkan_device *dev,
+		const struct gbm_vulkan_import_shm_data *shm_data, uint32_t usage) {
+	uint32_t format = core->v0.format_canonicalize(shm_data->format);
+	const struct vulkan_format_props *format_props = vulkan_format_props_from_drm(dev, format);
+	const struct pixel_format_info *info = drm_get_pixel_format_info(format);
+	if (!format_props || !info) {
+		fprintf(stderr, "no matching drm format 0x%08x available\n", format);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	const struct vulkan_format_modifier_props *mod = vulkan_format_props_find_modifier(
+		format_props, DRM_FORMAT_MOD_LINEAR, usage & GBM_BO_USE_RENDERING);
+	if (!mod || !vulkan_modifier_fits(mod, shm_data->width, shm_data->height)) {
+		fprintf(stderr, "linear layout not available for shm import\n");
+		errno = EINVAL;
+		return NULL;
+	}
+	if (info->block_width > 1 || shm_data->stride < (uint64_t)shm_data->width * info->bytes_per_block) {
+		fprintf(stderr, "invalid stride for shm import\n");
+		errno = EINVAL;
+		return NULL;
+	}
+
+	// udmabuf refuses memfds that could shrink under it
+	int seals = fcntl(shm_data->fd, F_GET_SEALS);
+	if (seals == -1) {
+		fprintf(stderr, "shm import requires a memfd\n");
+		errno = EINVAL;
+		return NULL;
+	}
+	// The memfd belongs to the caller, so it has to come sealed
+	if (!(seals & F_SEAL_SHRINK)) {
+		fprintf(stderr, "shm import requires a memfd sealed with F_SEAL_SHRINK\n");
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&dev->lock);
+	if (dev->udmabuf_fd == -1) {
+		dev->udmabuf_fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	}
+	int udmabuf_fd = dev->udmabuf_fd;
+	pthread_mutex_unlock(&dev->lock);
+	if (udmabuf_fd == -1) {
+		fprintf(stderr, "Could not open /dev/udmabuf: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	// udmabuf works on whole pages, the BO offset covers the remainder
+	uint64_t page_size = sysconf(_SC_PAGESIZE);
+	uint64_t page_offset = shm_data->offset & ~(page_size - 1);
+	uint64_t end = (uint64_t)shm_data->offset + (uint64_t)shm_data->stride * shm_data->height;
+	struct udmabuf_create create = {
+		.memfd = shm_data->fd,
+		.flags = UDMABUF_FLAGS_CLOEXEC,
+		.offset = page_offset,
+		.size = (end - page_offset + page_size - 1) & ~(page_size - 1),
+	};
+	int dmabuf_fd = ioctl(udmabuf_fd, UDMABUF_CREATE, &create);
+	if (dmabuf_fd < 0) {
+		fprintf(stderr, "Could not create udmabuf: %s\n", strerror(errno));
+		return NULL;
 	}
 
-	return false;
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo_alloc(&dev->base,
+		shm_data->width, shm_data->height, format);
+	if (bo == NULL) {
+		close(dmabuf_fd);
+		return NULL;
+	}
+	bo->import = calloc(1, sizeof(*bo->import));
+	if (bo->import == NULL) {
+		close(dmabuf_fd);
+		gbm_vulkan_bo_destroy(&bo->base);
+		return NULL;
+	}
+	bo->import->fds[0] = dmabuf_fd;
+	bo->import->owned = true;
+	bo->plane_cnt = 1;
+	bo->modifier = DRM_FORMAT_MOD_LINEAR;
+	bo->strides[0] = shm_data->stride;
+	bo->offsets[0] = shm_data->offset - page_offset;
+	return &bo->base;
 }
 
-static struct gbm_bo *gbm_vulkan_bo_import(struct gbm_device *gbm, uint32_t type,
+static struct gbm_bo *vulkan_bo_import(struct gbm_device *gbm, uint32_t type,
 		void *buffer, uint32_t usage) {
 	struct gbm_vulkan_device *dev = gbm_vulkan_device(gbm);
 
@@ -809,6 +4327,8 @@ static struct gbm_bo *gbm_vulkan_bo_import(struct gbm_device *gbm, uint32_t type
 	case GBM_BO_IMPORT_FD:
 		errno = ENOSYS;
 		return NULL;
+	case GBM_VULKAN_BO_IMPORT_SHM:
+		return gbm_vulkan_bo_import_shm(dev, buffer, usage);
 	case GBM_BO_IMPORT_FD_MODIFIER:;
       		struct gbm_import_fd_modifier_data *fd_data = buffer;
 		const struct vulkan_format_props *format_props =
@@ -848,21 +4368,18 @@ static struct gbm_bo *gbm_vulkan_bo_import(struct gbm_device *gbm, uint32_t type
 		}
 
 		// We will just record the parameters in the BO
-		struct gbm_vulkan_bo *bo = calloc(1, sizeof *bo);
+		struct gbm_vulkan_bo *bo = gbm_vulkan_bo_alloc(gbm,
+			fd_data->width, fd_data->height, fd_data->format);
 		if (bo == NULL) {
 			return NULL;
 		}
 
-		bo->base.gbm = gbm;
-		bo->base.v0.width = fd_data->width;
-		bo->base.v0.height = fd_data->height;
-		bo->base.v0.format = fd_data->format;
 		bo->plane_cnt = fd_data->num_fds;
 		bo->modifier = fd_data->modifier;
 
 		bo->import = calloc(1, sizeof(*bo->import));
 		if (bo->import == NULL) {
-			free(bo);
+			gbm_vulkan_bo_destroy(&bo->base);
 			return NULL;
 		}
 		for (uint32_t idx = 0; idx < fd_data->num_fds; idx++) {
@@ -879,25 +4396,205 @@ static struct gbm_bo *gbm_vulkan_bo_import(struct gbm_device *gbm, uint32_t type
 	}
 }
 
-static void *gbm_vulkan_bo_map(struct gbm_bo *_bo, uint32_t x, uint32_t y,
-		uint32_t width, uint32_t height, uint32_t flags, uint32_t *stride, void **map_data) {
-	(void)width, (void)height, (void)flags;
-	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
-	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
+static struct gbm_bo *gbm_vulkan_bo_import(struct gbm_device *gbm, uint32_t type,
+		void *buffer, uint32_t usage) {
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(gbm);
+	uint64_t start_ns = get_time_ns();
+	vulkan_trace_begin("bo_import type=0x%"PRIx32" usage=0x%"PRIx32, type, usage);
+	struct gbm_bo *bo = vulkan_bo_import(gbm, type, buffer, usage);
+	if (bo != NULL) {
+		vulkan_stats_count(&dev->stats.imports);
+	}
+	vulkan_stats_record(dev, GBM_VULKAN_STATS_OP_IMPORT, start_ns);
+	vulkan_trace_end_bo(bo);
+	return bo;
+}
+
+static void gbm_vulkan_bo_add_map(struct gbm_vulkan_device *dev, struct gbm_vulkan_map *map) {
+	pthread_mutex_lock(&dev->lock);
+	map->next = map->bo->maps;
+	map->bo->maps = map;
+	pthread_mutex_unlock(&dev->lock);
+}
+
+// Takes map_data off the list of maps of bo, returns NULL if it is not on it
+static struct gbm_vulkan_map *gbm_vulkan_bo_remove_map(struct gbm_vulkan_device *dev,
+		struct gbm_vulkan_bo *bo, void *map_data) {
+	pthread_mutex_lock(&dev->lock);
+	struct gbm_vulkan_map **link = &bo->maps;
+	while (*link != NULL && *link != map_data) {
+		link = &(*link)->next;
+	}
+	struct gbm_vulkan_map *map = *link;
+	if (map != NULL) {
+		*link = map->next;
+	}
+	pthread_mutex_unlock(&dev->lock);
+	return map;
+}
 
-	if (!bo->image) {
-		// We don't support mapping imported BO's for now, 
-		fprintf(stderr, "Attempted map for imported image\n");
+static void *gbm_vulkan_bo_map_staging(struct gbm_vulkan_device *dev, struct gbm_vulkan_bo *bo,
+		uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t flags,
+		uint32_t *stride, void **map_data) {
+	uint32_t bpp = vulkan_copy_bpp(bo);
+	if (bpp == 0 || !vulkan_copy_region_valid(bo, x, y, width, height)) {
+		fprintf(stderr, "Invalid map region\n");
 		errno = EINVAL;
 		return NULL;
 	}
 
-	if (bo->mapping) {
-		char *addr = bo->mapping->map + (bo->mapping->stride * y) + (x * bo->mapping->bpp);
-		bo->mapping->refcnt++;
-		*stride = bo->mapping->stride;
-		*map_data = bo;
-		return addr;
+	// Write-only maps are written back whole on unmap, so they start out
+	// zeroed rather than with whatever the allocator left behind
+	uint32_t map_stride = width * bpp;
+	size_t map_size = sizeof(struct gbm_vulkan_bo_staging_map) + (size_t)map_stride * height;
+	struct gbm_vulkan_bo_staging_map *map = (flags & GBM_BO_TRANSFER_READ) ?
+		malloc(map_size) : calloc(1, map_size);
+	if (map == NULL) {
+		return NULL;
+	}
+	*map = (struct gbm_vulkan_bo_staging_map){
+		.base = {
+			.bo = bo,
+			.kind = GBM_VULKAN_MAP_STAGING,
+		},
+		.x = x,
+		.y = y,
+		.width = width,
+		.height = height,
+		.flags = flags,
+		.stride = map_stride,
+	};
+	if ((flags & GBM_BO_TRANSFER_READ) &&
+			!vulkan_copy_bo_to_host(dev, bo, x, y, width, height, map->data, map_stride)) {
+		fprintf(stderr, "Could not read back BO for mapping\n");
+		free(map);
+		return NULL;
+	}
+
+	gbm_vulkan_bo_add_map(dev, &map->base);
+	*stride = map_stride;
+	*map_data = map;
+	return map->data;
+}
+
+static void gbm_vulkan_bo_unmap_staging(struct gbm_vulkan_device *dev,
+		struct gbm_vulkan_bo_staging_map *map) {
+	if ((map->flags & GBM_BO_TRANSFER_WRITE) &&
+			!vulkan_copy_host_to_bo(dev, map->base.bo, map->x, map->y, map->width, map->height,
+				map->data, map->stride)) {
+		fprintf(stderr, "Could not write back BO mapping\n");
+	}
+	free(map);
+}
+
+// Returns the properties of the memory gbm_bo_map hands out directly, or 0
+// for BOs that are only mapped through a copy
+static VkMemoryPropertyFlags gbm_vulkan_bo_host_memory_flags(const struct gbm_vulkan_bo *bo) {
+	if (bo->dumb) {
+		// Dumb buffers are mapped write-combined by most drivers
+		return VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	}
+	// Only linear, host-visible memory of our own can be mapped directly
+	if (!bo->image || bo->modifier != DRM_FORMAT_MOD_LINEAR ||
+			!(bo->mem_flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
+		return 0;
+	}
+	return bo->mem_flags;
+}
+
+// Maps the memory of a BO, or takes another reference on its mapping
+static char *gbm_vulkan_bo_mapping_get(struct gbm_vulkan_device *dev, struct gbm_vulkan_bo *bo) {
+	if (bo->dumb) {
+		return bo->dumb->map;
+	}
+	// Views share the mapping of the memory with their parent
+	if (bo->parent) {
+		bo = bo->parent;
+	}
+	int refcnt = atomic_load(&bo->mapping.refcnt);
+	while (refcnt > 0) {
+		if (atomic_compare_exchange_weak(&bo->mapping.refcnt, &refcnt, refcnt + 1)) {
+			return bo->mapping.map;
+		}
+	}
+
+	pthread_mutex_lock(&dev->lock);
+	char *map = NULL;
+	if (atomic_load(&bo->mapping.refcnt) > 0) {
+		// Mapped by another thread meanwhile
+		atomic_fetch_add(&bo->mapping.refcnt, 1);
+		map = bo->mapping.map;
+	} else if (vkMapMemory(dev->device, bo->memory, 0, VK_WHOLE_SIZE, 0, (void**)&map) == VK_SUCCESS) {
+		bo->mapping.map = map;
+		atomic_store(&bo->mapping.refcnt, 1);
+	} else {
+		fprintf(stderr, "Mapping memory failed\n");
+		map = NULL;
+		errno = ENOMEM;
+	}
+	pthread_mutex_unlock(&dev->lock);
+	return map;
+}
+
+static void gbm_vulkan_bo_mapping_put(struct gbm_vulkan_device *dev, struct gbm_vulkan_bo *bo) {
+	if (bo->dumb) {
+		// Persistently mapped
+		return;
+	}
+	if (bo->parent) {
+		bo = bo->parent;
+	}
+	int refcnt = atomic_load(&bo->mapping.refcnt);
+	while (refcnt > 1) {
+		if (atomic_compare_exchange_weak(&bo->mapping.refcnt, &refcnt, refcnt - 1)) {
+			return;
+		}
+	}
+
+	pthread_mutex_lock(&dev->lock);
+	if (atomic_fetch_sub(&bo->mapping.refcnt, 1) == 1) {
+		vkUnmapMemory(dev->device, bo->memory);
+		bo->mapping.map = NULL;
+	}
+	pthread_mutex_unlock(&dev->lock);
+}
+
+// Copies rows into write-combined memory. Non-temporal stores fill whole
+// write-combining buffers and keep the destination out of the caches.
+static void stream_rows(char *dst, size_t dst_stride, const char *src, size_t src_stride,
+		size_t row_size, uint32_t rows) {
+#if defined(__SSE2__)
+	for (uint32_t row = 0; row < rows; row++) {
+		char *d = dst + row * dst_stride;
+		const char *s = src + row * src_stride;
+		size_t len = row_size;
+		size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+		if (head > len) {
+			head = len;
+		}
+		memcpy(d, s, head);
+		d += head;
+		s += head;
+		len -= head;
+		for (; len >= 16; len -= 16, s += 16, d += 16) {
+			_mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+		}
+		memcpy(d, s, len);
+	}
+	_mm_sfence();
+#else
+	copy_rows(dst, dst_stride, src, src_stride, row_size, rows);
+#endif
+}
+
+static void *vulkan_bo_map(struct gbm_bo *_bo, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height, uint32_t flags, uint32_t *stride, void **map_data) {
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
+
+	VkMemoryPropertyFlags mem_flags = gbm_vulkan_bo_host_memory_flags(bo);
+	if (mem_flags == 0) {
+		return gbm_vulkan_bo_map_staging(dev, bo, x, y, width, height, flags, stride, map_data);
 	}
 
 	const struct pixel_format_info *info = drm_get_pixel_format_info(bo->base.v0.format);
@@ -906,88 +4603,716 @@ static void *gbm_vulkan_bo_map(struct gbm_bo *_bo, uint32_t x, uint32_t y,
 		errno = EINVAL;
 		return NULL;
 	}
+	if (!vulkan_copy_region_valid(bo, x, y, width, height)) {
+		fprintf(stderr, "Invalid map region\n");
+		errno = EINVAL;
+		return NULL;
+	}
 
-	bo->mapping = calloc(1, sizeof(*bo->mapping));
-	if (bo->mapping == NULL) {
+	char *base = gbm_vulkan_bo_mapping_get(dev, bo);
+	if (base == NULL) {
 		return NULL;
 	}
-	// TODO: Validate stride, dimensions
-	
-	if (vkMapMemory(dev->device, bo->memory, 0, VK_WHOLE_SIZE, 0, (void**)&bo->mapping->map) != VK_SUCCESS) {
-		fprintf(stderr, "Mapping memory failed\n");
+	uint32_t bo_stride = bo->strides[0];
+	char *addr = base + bo->offsets[0] + (size_t)bo_stride * y + (size_t)x * info->bytes_per_block;
+
+	bool coherent = mem_flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	// Reading uncached memory is slow enough that write-only mappings get a
+	// bounce buffer, streamed out on unmap
+	bool bounce = (flags & GBM_BO_TRANSFER_READ_WRITE) == GBM_BO_TRANSFER_WRITE &&
+		!(mem_flags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+	if (coherent && !bounce) {
+		*stride = bo_stride;
+		*map_data = bo;
+		return addr;
+	}
+
+	// The bounce buffer is streamed out whole, so it starts out zeroed
+	// rather than with whatever the allocator left behind
+	uint32_t row_size = width * info->bytes_per_block;
+	struct gbm_vulkan_bo_memory_map *map = bounce ?
+		calloc(1, sizeof(*map) + (size_t)row_size * height) : malloc(sizeof(*map));
+	if (map == NULL) {
+		gbm_vulkan_bo_mapping_put(dev, bo);
 		return NULL;
 	}
 
-	VkImageSubresource img_sub_res = {
-		.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-		.arrayLayer = 0,
-		.mipLevel = 0,
+	// Cache maintenance works on whole atoms, and the range must not reach
+	// past the end of the allocation unless it is VK_WHOLE_SIZE
+	VkDeviceSize atom = dev->non_coherent_atom_size ? dev->non_coherent_atom_size : 1;
+	VkDeviceSize start = addr - base;
+	VkDeviceSize end = start + (VkDeviceSize)bo_stride * (height - 1) + row_size;
+	start -= start % atom;
+	end = (end + atom - 1) / atom * atom;
+	*map = (struct gbm_vulkan_bo_memory_map){
+		.base = {
+			.bo = bo,
+			.kind = GBM_VULKAN_MAP_MEMORY,
+		},
+		.flags = flags,
+		.coherent = coherent,
+		.bounce = bounce,
+		.offset = start,
+		.size = end >= bo->mem_size ? VK_WHOLE_SIZE : end - start,
+		.addr = addr,
+		.row_size = row_size,
+		.height = height,
 	};
-	VkSubresourceLayout img_sub_layout;
-	vkGetImageSubresourceLayout(dev->device, bo->image, &img_sub_res, &img_sub_layout);
-	bo->mapping->stride = img_sub_layout.rowPitch;
-	bo->mapping->bpp = info->bytes_per_block;
 
-	char *addr = bo->mapping->map + (bo->mapping->stride * y) + (x * bo->mapping->bpp);
-	bo->mapping->refcnt++;
-	*stride = bo->mapping->stride;
-	*map_data = bo;
+	if (!coherent && (flags & GBM_BO_TRANSFER_READ)) {
+		VkMappedMemoryRange range = {
+			.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+			.memory = bo->memory,
+			.offset = map->offset,
+			.size = map->size,
+		};
+		if (vkInvalidateMappedMemoryRanges(dev->device, 1, &range) != VK_SUCCESS) {
+			fprintf(stderr, "Could not invalidate BO mapping\n");
+			free(map);
+			gbm_vulkan_bo_mapping_put(dev, bo);
+			errno = EIO;
+			return NULL;
+		}
+	}
+
+	gbm_vulkan_bo_add_map(dev, &map->base);
+	*map_data = map;
+	if (bounce) {
+		*stride = row_size;
+		return map->data;
+	}
+	*stride = bo_stride;
+	return addr;
+}
+
+static void *gbm_vulkan_bo_map(struct gbm_bo *_bo, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height, uint32_t flags, uint32_t *stride, void **map_data) {
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
+	uint64_t start_ns = get_time_ns();
+	vulkan_trace_begin("bo_map bo=%"PRIu64" %"PRIu32"x%"PRIu32"+%"PRIu32"+%"PRIu32" flags=0x%"PRIx32,
+		gbm_vulkan_bo(_bo)->id, width, height, x, y, flags);
+	void *addr = vulkan_bo_map(_bo, x, y, width, height, flags, stride, map_data);
+	if (addr != NULL) {
+		vulkan_stats_count(&dev->stats.maps);
+	}
+	vulkan_stats_record(dev, GBM_VULKAN_STATS_OP_MAP, start_ns);
+	vulkan_trace_end("mapped=%d", addr != NULL);
 	return addr;
 }
 
+static void gbm_vulkan_bo_unmap_memory(struct gbm_vulkan_device *dev,
+		struct gbm_vulkan_bo_memory_map *map) {
+	struct gbm_vulkan_bo *bo = map->base.bo;
+	if (map->bounce) {
+		stream_rows(map->addr, bo->strides[0], map->data, map->row_size, map->row_size, map->height);
+	}
+	if (!map->coherent && (map->flags & GBM_BO_TRANSFER_WRITE)) {
+		VkMappedMemoryRange range = {
+			.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+			.memory = bo->memory,
+			.offset = map->offset,
+			.size = map->size,
+		};
+		if (vkFlushMappedMemoryRanges(dev->device, 1, &range) != VK_SUCCESS) {
+			fprintf(stderr, "Could not flush BO mapping\n");
+		}
+	}
+	gbm_vulkan_bo_mapping_put(dev, bo);
+	free(map);
+}
+
+struct gbm_vulkan_bo_convert_map;
+static void gbm_vulkan_bo_unmap_convert(struct gbm_vulkan_device *dev,
+		struct gbm_vulkan_bo_convert_map *map);
+
 static void gbm_vulkan_bo_unmap(struct gbm_bo *_bo, void *map_data) {
 	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
 	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
+	struct gbm_vulkan_map *map = map_data != _bo ? gbm_vulkan_bo_remove_map(dev, bo, map_data) : NULL;
+	if (map != NULL) {
+		switch (map->kind) {
+		case GBM_VULKAN_MAP_STAGING:
+			gbm_vulkan_bo_unmap_staging(dev, (struct gbm_vulkan_bo_staging_map *)map);
+			break;
+		case GBM_VULKAN_MAP_MEMORY:
+			gbm_vulkan_bo_unmap_memory(dev, (struct gbm_vulkan_bo_memory_map *)map);
+			break;
+		case GBM_VULKAN_MAP_CONVERT:
+			gbm_vulkan_bo_unmap_convert(dev, (struct gbm_vulkan_bo_convert_map *)map);
+			break;
+		}
+		return;
+	}
 	if (map_data != _bo) {
 		fprintf(stderr, "Attempted unmap with invalid map_data\n");
 		errno = EINVAL;
 		return;
 	}
-	if (!bo->mapping) {
+	struct gbm_vulkan_bo *owner = bo->parent ? bo->parent : bo;
+	if (!bo->dumb && atomic_load(&owner->mapping.refcnt) == 0) {
 		fprintf(stderr, "Attempted unmap without mapping\n");
 		errno = EINVAL;
 		return;
 	}
-	if (--bo->mapping->refcnt == 0) {
-		vkUnmapMemory(dev->device, bo->memory);
-		free(bo->mapping);
-		bo->mapping = NULL;
+	gbm_vulkan_bo_mapping_put(dev, bo);
+}
+
+uint32_t gbm_vulkan_bo_get_memory_flags(struct gbm_bo *_bo) {
+	VkMemoryPropertyFlags mem_flags = gbm_vulkan_bo_host_memory_flags(gbm_vulkan_bo(_bo));
+	if (mem_flags == 0) {
+		return 0;
+	}
+	uint32_t flags = GBM_VULKAN_MEMORY_MAPPABLE;
+	if (mem_flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) {
+		flags |= GBM_VULKAN_MEMORY_COHERENT;
+	}
+	if (mem_flags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT) {
+		flags |= GBM_VULKAN_MEMORY_CACHED;
+	}
+	return flags;
+}
+
+dev_t gbm_vulkan_bo_get_device(struct gbm_bo *_bo, uint32_t *flags) {
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
+	if (flags != NULL) {
+		*flags = 0;
+		if (bo->system_memory) {
+			*flags |= GBM_VULKAN_BO_SYSTEM_MEMORY;
+		}
+		if (bo->prime) {
+			*flags |= GBM_VULKAN_BO_PRIME;
+		}
+	}
+	return dev->devid;
+}
+
+// CPU-side conversion between 32-bit RGB formats that only differ in
+// channel order, byte order and whether alpha is used. Every conversion is
+// a byte shuffle within each pixel, plus forcing alpha to opaque when the
+// source has none.
+struct vulkan_cpu_format {
+	uint32_t format;
+	// Byte offsets of the channels in memory, a is that of X if !alpha
+	uint8_t r, g, b, a;
+	bool alpha;
+};
+
+static const struct vulkan_cpu_format vulkan_cpu_formats[] = {
+	{ DRM_FORMAT_XRGB8888, 2, 1, 0, 3, false },
+	{ DRM_FORMAT_ARGB8888, 2, 1, 0, 3, true },
+	{ DRM_FORMAT_XBGR8888, 0, 1, 2, 3, false },
+	{ DRM_FORMAT_ABGR8888, 0, 1, 2, 3, true },
+	{ DRM_FORMAT_RGBX8888, 3, 2, 1, 0, false },
+	{ DRM_FORMAT_RGBA8888, 3, 2, 1, 0, true },
+	{ DRM_FORMAT_BGRX8888, 1, 2, 3, 0, false },
+	{ DRM_FORMAT_BGRA8888, 1, 2, 3, 0, true },
+};
+
+struct vulkan_pixel_conversion {
+	// Source byte for each destination byte of four consecutive pixels
+	uint8_t shuffle[16];
+	uint32_t alpha_mask;
+};
+
+// Looks up a format, honouring DRM_FORMAT_BIG_ENDIAN by mirroring the
+// byte offsets
+static bool vulkan_cpu_format_get(uint32_t format, struct vulkan_cpu_format *out) {
+	bool big_endian = format & DRM_FORMAT_BIG_ENDIAN;
+	format &= ~DRM_FORMAT_BIG_ENDIAN;
+	for (size_t i = 0; i < ARRAY_SIZE(vulkan_cpu_formats); i++) {
+		if (vulkan_cpu_formats[i].format != format) {
+			continue;
+		}
+		*out = vulkan_cpu_formats[i];
+		if (big_endian) {
+			out->r = 3 - out->r;
+			out->g = 3 - out->g;
+			out->b = 3 - out->b;
+			out->a = 3 - out->a;
+		}
+		return true;
+	}
+	return false;
+}
+
+static bool vulkan_pixel_conversion_init(struct vulkan_pixel_conversion *conv,
+		uint32_t src_format, uint32_t dst_format) {
+	struct vulkan_cpu_format src, dst;
+	if (!vulkan_cpu_format_get(src_format, &src) || !vulkan_cpu_format_get(dst_format, &dst)) {
+		return false;
+	}
+
+	uint8_t perm[4];
+	perm[dst.r] = src.r;
+	perm[dst.g] = src.g;
+	perm[dst.b] = src.b;
+	perm[dst.a] = src.a;
+	for (int i = 0; i < 16; i++) {
+		conv->shuffle[i] = (i & ~3) + perm[i & 3];
+	}
+
+	conv->alpha_mask = 0;
+	if (dst.alpha && !src.alpha) {
+		// Memory order, regardless of host endianness
+		uint8_t mask_bytes[4] = {0};
+		mask_bytes[dst.a] = 0xff;
+		memcpy(&conv->alpha_mask, mask_bytes, sizeof(conv->alpha_mask));
+	}
+	return true;
+}
+
+static void vulkan_convert_row_scalar(uint8_t *dst, const uint8_t *src, size_t pixels,
+		const struct vulkan_pixel_conversion *conv) {
+	for (size_t i = 0; i < pixels; i++, src += 4, dst += 4) {
+		uint8_t px[4] = { src[conv->shuffle[0]], src[conv->shuffle[1]],
+			src[conv->shuffle[2]], src[conv->shuffle[3]] };
+		uint32_t value;
+		memcpy(&value, px, sizeof(value));
+		value |= conv->alpha_mask;
+		memcpy(dst, &value, sizeof(value));
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+static void vulkan_convert_row_ssse3(uint8_t *dst, const uint8_t *src, size_t pixels,
+		const struct vulkan_pixel_conversion *conv) {
+	__m128i shuffle = _mm_loadu_si128((const __m128i *)conv->shuffle);
+	__m128i alpha = _mm_set1_epi32(conv->alpha_mask);
+	size_t i = 0;
+	for (; i + 4 <= pixels; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		v = _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha);
+		_mm_storeu_si128((__m128i *)(dst + i * 4), v);
+	}
+	vulkan_convert_row_scalar(dst + i * 4, src + i * 4, pixels - i, conv);
+}
+
+__attribute__((target("avx2")))
+static void vulkan_convert_row_avx2(uint8_t *dst, const uint8_t *src, size_t pixels,
+		const struct vulkan_pixel_conversion *conv) {
+	// vpshufb works per 128-bit lane, so the same mask serves both lanes
+	__m256i shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)conv->shuffle));
+	__m256i alpha = _mm256_set1_epi32(conv->alpha_mask);
+	size_t i = 0;
+	for (; i + 8 <= pixels; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+		v = _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha);
+		_mm256_storeu_si256((__m256i *)(dst + i * 4), v);
+	}
+	vulkan_convert_row_ssse3(dst + i * 4, src + i * 4, pixels - i, conv);
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static void vulkan_convert_row_neon(uint8_t *dst, const uint8_t *src, size_t pixels,
+		const struct vulkan_pixel_conversion *conv) {
+	uint8x16_t shuffle = vld1q_u8(conv->shuffle);
+	uint8x16_t alpha = vreinterpretq_u8_u32(vdupq_n_u32(conv->alpha_mask));
+	size_t i = 0;
+	for (; i + 4 <= pixels; i += 4) {
+		uint8x16_t v = vld1q_u8(src + i * 4);
+		vst1q_u8(dst + i * 4, vorrq_u8(vqtbl1q_u8(v, shuffle), alpha));
+	}
+	vulkan_convert_row_scalar(dst + i * 4, src + i * 4, pixels - i, conv);
+}
+#endif
+
+typedef void (*vulkan_convert_row_fn)(uint8_t *dst, const uint8_t *src, size_t pixels,
+	const struct vulkan_pixel_conversion *conv);
+
+static vulkan_convert_row_fn vulkan_select_convert_row(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return vulkan_convert_row_avx2;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		return vulkan_convert_row_ssse3;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	return vulkan_convert_row_neon;
+#endif
+	return vulkan_convert_row_scalar;
+}
+
+static void vulkan_convert_rect(const struct gbm_vulkan_device *dev,
+		char *dst, uint32_t dst_stride, const char *src, uint32_t src_stride,
+		uint32_t width, uint32_t height, const struct vulkan_pixel_conversion *conv) {
+	for (uint32_t row = 0; row < height; row++) {
+		dev->convert_row((uint8_t *)dst + (size_t)row * dst_stride,
+			(const uint8_t *)src + (size_t)row * src_stride, width, conv);
+	}
+}
+
+struct gbm_vulkan_bo_convert_map {
+	struct gbm_vulkan_map base;
+	// Mapping of the BO in its own format
+	void *inner_data;
+	char *inner;
+	uint32_t inner_stride;
+	uint32_t width, height, flags;
+	// From the mapped format to that of the BO
+	struct vulkan_pixel_conversion to_bo;
+	uint32_t stride;
+	char data[];
+};
+
+void *gbm_vulkan_bo_map_format(struct gbm_bo *_bo, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height, uint32_t flags, uint32_t format,
+		uint32_t *stride, void **map_data) {
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
+	if (format == bo->base.v0.format) {
+		return gbm_vulkan_bo_map(_bo, x, y, width, height, flags, stride, map_data);
+	}
+
+	struct vulkan_pixel_conversion from_bo;
+	struct vulkan_pixel_conversion to_bo;
+	if (!vulkan_pixel_conversion_init(&from_bo, bo->base.v0.format, format) ||
+			!vulkan_pixel_conversion_init(&to_bo, format, bo->base.v0.format)) {
+		fprintf(stderr, "Cannot convert between drm formats 0x%08x and 0x%08x\n",
+			bo->base.v0.format, format);
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!vulkan_copy_region_valid(bo, x, y, width, height)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	// Converted back whole on unmap, like the maps of gbm_vulkan_bo_map
+	uint32_t map_stride = width * 4;
+	struct gbm_vulkan_bo_convert_map *map = calloc(1, sizeof(*map) + (size_t)map_stride * height);
+	if (map == NULL) {
+		return NULL;
+	}
+	*map = (struct gbm_vulkan_bo_convert_map){
+		.base = {
+			.bo = bo,
+			.kind = GBM_VULKAN_MAP_CONVERT,
+		},
+		.width = width,
+		.height = height,
+		.flags = flags,
+		.to_bo = to_bo,
+		.stride = map_stride,
+	};
+	map->inner = gbm_vulkan_bo_map(_bo, x, y, width, height, flags,
+		&map->inner_stride, &map->inner_data);
+	if (map->inner == NULL) {
+		free(map);
+		return NULL;
+	}
+	if (flags & GBM_BO_TRANSFER_READ) {
+		vulkan_convert_rect(dev, map->data, map_stride, map->inner, map->inner_stride,
+			width, height, &from_bo);
+	}
+
+	gbm_vulkan_bo_add_map(dev, &map->base);
+	*stride = map_stride;
+	*map_data = map;
+	return map->data;
+}
+
+static void gbm_vulkan_bo_unmap_convert(struct gbm_vulkan_device *dev,
+		struct gbm_vulkan_bo_convert_map *map) {
+	if (map->flags & GBM_BO_TRANSFER_WRITE) {
+		vulkan_convert_rect(dev, map->inner, map->inner_stride, map->data, map->stride,
+			map->width, map->height, &map->to_bo);
+	}
+	gbm_vulkan_bo_unmap(&map->base.bo->base, map->inner_data);
+	free(map);
+}
+
+int gbm_vulkan_bo_write_format(struct gbm_bo *_bo, const void *buf, size_t count, uint32_t format) {
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
+	if (format == bo->base.v0.format) {
+		return gbm_vulkan_bo_write(_bo, buf, count);
+	}
+
+	struct vulkan_pixel_conversion to_bo;
+	if (!vulkan_pixel_conversion_init(&to_bo, format, bo->base.v0.format)) {
+		fprintf(stderr, "Cannot convert between drm formats 0x%08x and 0x%08x\n",
+			format, bo->base.v0.format);
+		errno = EINVAL;
+		return -1;
+	}
+
+	// Tightly packed rows like gbm_bo_write, converted straight into the
+	// BO mapping
+	size_t row_size = (size_t)bo->base.v0.width * 4;
+	size_t rows = count / row_size;
+	if (rows > bo->base.v0.height) {
+		rows = bo->base.v0.height;
+	}
+	if (rows == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	uint32_t stride;
+	void *map_data;
+	char *dst = gbm_vulkan_bo_map(_bo, 0, 0, bo->base.v0.width, rows, GBM_BO_TRANSFER_WRITE,
+		&stride, &map_data);
+	if (dst == NULL) {
+		return -1;
+	}
+	vulkan_convert_rect(dev, dst, stride, buf, row_size, bo->base.v0.width, rows, &to_bo);
+	gbm_vulkan_bo_unmap(_bo, map_data);
+	return 0;
+}
+
+struct gbm_vulkan_readback {
+	struct gbm_vulkan_device *dev;
+	struct vulkan_copy_slot *slot;
+	uint64_t point;
+	uint32_t stride;
+};
+
+struct gbm_vulkan_readback *gbm_vulkan_bo_readback(struct gbm_bo *_bo,
+		uint32_t x, uint32_t y, uint32_t width, uint32_t height, int *fence_fd) {
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(_bo->gbm);
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+	if (fence_fd != NULL) {
+		*fence_fd = -1;
+	}
+	struct gbm_vulkan_readback *readback = calloc(1, sizeof(*readback));
+	if (readback == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&dev->copy_lock);
+	if (dev->copy.held_count >= VULKAN_COPY_MAX_HELD) {
+		errno = EBUSY;
+		goto error;
+	}
+	struct vulkan_copy_slot *slot = vulkan_copy_record_readback(dev, bo, x, y, width, height);
+	if (slot == NULL) {
+		goto error;
+	}
+	struct vulkan_copy_access access = { .bo = bo, .write = false };
+	uint64_t point = vulkan_copy_submit_implicit(dev, slot, &access, 1, fence_fd);
+	if (point == 0) {
+		goto error;
+	}
+	// The BO must outlive the copy, see gbm_vulkan_bo_destroy
+	bo->transfer->point = point;
+
+	slot->held = true;
+	dev->copy.held_count++;
+	pthread_mutex_unlock(&dev->copy_lock);
+	*readback = (struct gbm_vulkan_readback){
+		.dev = dev,
+		.slot = slot,
+		.point = point,
+		.stride = width * vulkan_copy_bpp(bo),
+	};
+	return readback;
+
+error:
+	pthread_mutex_unlock(&dev->copy_lock);
+	free(readback);
+	return NULL;
+}
+
+const void *gbm_vulkan_readback_map(struct gbm_vulkan_readback *readback, uint32_t *stride) {
+	if (!vulkan_copy_wait(readback->dev, readback->point)) {
+		return NULL;
+	}
+	*stride = readback->stride;
+	return readback->slot->staging.map;
+}
+
+void gbm_vulkan_readback_release(struct gbm_vulkan_readback *readback) {
+	// The slot is only reused after its timeline point has passed, so
+	// there is no need to wait here
+	struct gbm_vulkan_device *dev = readback->dev;
+	pthread_mutex_lock(&dev->copy_lock);
+	readback->slot->held = false;
+	dev->copy.held_count--;
+	pthread_mutex_unlock(&dev->copy_lock);
+	free(readback);
+}
+
+static uint32_t dmabuf_sync_flags(uint32_t flags) {
+	uint32_t sync_flags = 0;
+	if (flags & GBM_BO_TRANSFER_READ) {
+		sync_flags |= DMA_BUF_SYNC_READ;
+	}
+	if (flags & GBM_BO_TRANSFER_WRITE) {
+		sync_flags |= DMA_BUF_SYNC_WRITE;
+	}
+	return sync_flags;
+}
+
+int gbm_vulkan_bo_export_sync_file(struct gbm_bo *_bo, uint32_t flags) {
+	uint32_t sync_flags = dmabuf_sync_flags(flags);
+	if (sync_flags == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	int sync_file = vulkan_bo_export_sync_file(gbm_vulkan_bo(_bo), sync_flags);
+	if (sync_file == -1) {
+		int saved_errno = errno;
+		fprintf(stderr, "Could not export sync_file from dma-buf: %s\n", strerror(errno));
+		errno = saved_errno;
+	}
+	return sync_file;
+}
+
+int gbm_vulkan_bo_import_sync_file(struct gbm_bo *_bo, int sync_file, uint32_t flags) {
+	uint32_t sync_flags = dmabuf_sync_flags(flags);
+	if (sync_flags == 0 || sync_file < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!vulkan_bo_import_sync_file(gbm_vulkan_bo(_bo), sync_file, sync_flags)) {
+		int saved_errno = errno;
+		fprintf(stderr, "Could not import sync_file into dma-buf: %s\n", strerror(errno));
+		errno = saved_errno;
+		return -1;
+	}
+	return 0;
+}
+
+int gbm_vulkan_bo_copy(struct gbm_bo *dst, uint32_t dst_x, uint32_t dst_y,
+		struct gbm_bo *src, uint32_t src_x, uint32_t src_y, uint32_t width, uint32_t height) {
+	if (dst->gbm != src->gbm) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(dst->gbm);
+	if (!vulkan_copy_bo_to_bo(dev, gbm_vulkan_bo(src), src_x, src_y,
+			gbm_vulkan_bo(dst), dst_x, dst_y, width, height)) {
+		return -1;
+	}
+	return 0;
+}
+
+static inline struct gbm_vulkan_surface *gbm_vulkan_surface(struct gbm_surface *surf) {
+	return (struct gbm_vulkan_surface *)surf;
+}
+
+static void gbm_vulkan_surface_destroy(struct gbm_surface *_surf) {
+	struct gbm_vulkan_surface *surf = gbm_vulkan_surface(_surf);
+	for (uint32_t idx = 0; idx < surf->buffer_count; idx++) {
+		if (surf->locked[idx]) {
+			fprintf(stderr, "!!! Surface destroyed with locked buffer\n");
+		}
+		// Clients hang framebuffers off the BOs, which libgbm only frees
+		// through gbm_bo_destroy
+		struct gbm_bo *bo = &surf->buffers[idx]->base;
+		if (bo->v0.destroy_user_data) {
+			bo->v0.destroy_user_data(bo, bo->v0.user_data);
+		}
+		gbm_vulkan_bo_reclaim(bo);
 	}
+	free(surf->base.v0.modifiers);
+	free(surf);
 }
 
 static struct gbm_surface *gbm_vulkan_surface_create(struct gbm_device *gbm,
 		uint32_t width, uint32_t height, uint32_t format, uint32_t flags,
 		const uint64_t *modifiers, const unsigned count) {
-	(void)gbm, (void)width, (void)height, (void)format, (void)flags, (void)modifiers, (void)count;
-	// NOT IMPLEMENTED
-	errno = ENOSYS;
-	return NULL;
+	struct gbm_vulkan_device *dev = gbm_vulkan_device(gbm);
+	struct gbm_vulkan_surface *surf = calloc(1, sizeof(*surf));
+	if (surf == NULL) {
+		return NULL;
+	}
+	surf->base.gbm = gbm;
+	surf->base.v0.width = width;
+	surf->base.v0.height = height;
+	surf->base.v0.format = format;
+	surf->base.v0.flags = flags;
+	if (count > 0) {
+		surf->base.v0.modifiers = calloc(count, sizeof(*modifiers));
+		if (surf->base.v0.modifiers == NULL) {
+			free(surf);
+			return NULL;
+		}
+		memcpy(surf->base.v0.modifiers, modifiers, count * sizeof(*modifiers));
+		surf->base.v0.count = count;
+	}
+
+	// The whole ring is allocated upfront. The first buffer negotiates the
+	// modifier and the others are allocated with it, so that every buffer
+	// of the surface has the same layout.
+	for (uint32_t idx = 0; idx < dev->surface_buffers; idx++) {
+		const uint64_t *mods = modifiers;
+		unsigned mod_count = count;
+		if (idx > 0) {
+			mods = &surf->buffers[0]->modifier;
+			mod_count = 1;
+		}
+		struct gbm_bo *bo = gbm_vulkan_bo_create(gbm, width, height, format, flags, mods, mod_count);
+		if (bo == NULL) {
+			fprintf(stderr, "Could not allocate buffer %"PRIu32" of surface\n", idx);
+			gbm_vulkan_surface_destroy(&surf->base);
+			return NULL;
+		}
+		surf->buffers[idx] = gbm_vulkan_bo(bo);
+		surf->buffers[idx]->surface = surf;
+		surf->buffers[idx]->surface_index = idx;
+		surf->buffer_count++;
+	}
+	for (uint32_t idx = 0; idx < surf->buffer_count; idx++) {
+		surf->free[idx] = surf->buffer_count - 1 - idx;
+	}
+	surf->free_count = surf->buffer_count;
+	return &surf->base;
 }
 
-static void gbm_vulkan_surface_destroy(struct gbm_surface *_surf) {
-	(void)_surf;
-	// NOT IMPLEMENTED
-	errno = ENOSYS;
+static struct gbm_vulkan_bo *gbm_vulkan_surface_take_free(struct gbm_vulkan_surface *surf) {
+	if (surf->free_count == 0) {
+		return NULL;
+	}
+	return surf->buffers[surf->free[--surf->free_count]];
+}
+
+struct gbm_bo *gbm_vulkan_surface_get_back_buffer(struct gbm_surface *_surf) {
+	struct gbm_vulkan_surface *surf = gbm_vulkan_surface(_surf);
+	if (surf->back == NULL) {
+		surf->back = gbm_vulkan_surface_take_free(surf);
+		if (surf->back == NULL) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+	return &surf->back->base;
 }
 
 static struct gbm_bo *gbm_vulkan_surface_lock_front_buffer(struct gbm_surface *_surf) {
-	(void)_surf;
-	// NOT IMPLEMENTED
-	errno = ENOSYS;
-	return NULL;
+	struct gbm_vulkan_surface *surf = gbm_vulkan_surface(_surf);
+	// Without a back buffer handed out, the next free buffer is as good
+	struct gbm_vulkan_bo *bo = surf->back;
+	if (bo == NULL) {
+		bo = gbm_vulkan_surface_take_free(surf);
+	}
+	if (bo == NULL) {
+		fprintf(stderr, "No free buffer to lock\n");
+		errno = EBUSY;
+		return NULL;
+	}
+	surf->back = NULL;
+	surf->locked[bo->surface_index] = true;
+	return &bo->base;
 }
 
 static void gbm_vulkan_surface_release_buffer(struct gbm_surface *_surf, struct gbm_bo *_bo) {
-	(void)_surf, (void)_bo;
-	// NOT IMPLEMENTED
-	errno = ENOSYS;
+	struct gbm_vulkan_surface *surf = gbm_vulkan_surface(_surf);
+	struct gbm_vulkan_bo *bo = gbm_vulkan_bo(_bo);
+	if (bo->surface != surf || !surf->locked[bo->surface_index]) {
+		fprintf(stderr, "Attempted to release buffer that is not locked\n");
+		errno = EINVAL;
+		return;
+	}
+	surf->locked[bo->surface_index] = false;
+	surf->free[surf->free_count++] = bo->surface_index;
 }
 
 static int gbm_vulkan_surface_has_free_buffers(struct gbm_surface *_surf) {
-	(void)_surf;
-	// NOT IMPLEMENTED
-	errno = ENOSYS;
-	return -1;
+	struct gbm_vulkan_surface *surf = gbm_vulkan_surface(_surf);
+	return surf->back != NULL || surf->free_count > 0;
 }
 
 static void log_phdev(const VkPhysicalDeviceProperties *props) {
@@ -1045,6 +5370,32 @@ static int vulkan_select_queue_family(VkPhysicalDevice phdev) {
 	return -1;
 }
 
+static int vulkan_select_transfer_queue_family(VkPhysicalDevice phdev) {
+	uint32_t qfam_count;
+	vkGetPhysicalDeviceQueueFamilyProperties(phdev, &qfam_count, NULL);
+	assert(qfam_count > 0);
+	VkQueueFamilyProperties queue_props[qfam_count];
+	vkGetPhysicalDeviceQueueFamilyProperties(phdev, &qfam_count, queue_props);
+
+	// Transfer-only families usually map to dedicated copy engines that
+	// run alongside rendering. Skip those with a coarse transfer
+	// granularity, as our copies are of arbitrary regions.
+	for (unsigned i = 0u; i < qfam_count; ++i) {
+		VkQueueFlags flags = queue_props[i].queueFlags;
+		VkExtent3D granularity = queue_props[i].minImageTransferGranularity;
+		if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) &&
+				granularity.width == 1 && granularity.height == 1) {
+			return i;
+		}
+	}
+	// Graphics and compute queues support transfers too
+	for (unsigned i = 0u; i < qfam_count; ++i) {
+		if (queue_props[i].queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) {
+			return i;
+		}
+	}
+	return -1;
+}
 
 static bool query_modifier_usage_support(VkPhysicalDevice phdev,
 		VkFormat vk_format, VkFormat vk_format_variant, VkImageUsageFlags usage,
@@ -1100,6 +5451,7 @@ static bool query_modifier_usage_support(VkPhysicalDevice phdev,
 		.props = *m,
 		.max_extent.width = me.width,
 		.max_extent.height = me.height,
+		.mod_class = vulkan_modifier_classify(m),
 	};
 	return true;
 }
@@ -1194,9 +5546,10 @@ static bool query_modifier_support(VkPhysicalDevice phdev,
 
 		char *modifier_name = drmGetFormatModifierName(m.drmFormatModifier);
 		fprintf(stderr, "    DMA-BUF modifier %s "
-			"(0x%016"PRIX64", %"PRIu32" planes)\n",
+			"(0x%016"PRIX64", %"PRIu32" planes, %s)\n",
 			modifier_name ? modifier_name : "<unknown>", m.drmFormatModifier,
-			m.drmFormatModifierPlaneCount);
+			m.drmFormatModifierPlaneCount,
+			vulkan_modifier_class_names[vulkan_modifier_classify(&m)]);
 		free(modifier_name);
 	}
 
@@ -1233,17 +5586,411 @@ static void vulkan_format_props_query(struct gbm_vulkan_device *dev,
 	}
 }
 
+static bool host_copy_layouts_contain(const VkImageLayout *layouts, uint32_t count,
+		VkImageLayout layout) {
+	for (uint32_t idx = 0; idx < count; idx++) {
+		if (layouts[idx] == layout) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Host copies access images in the general layout, which the device has to
+// list among the layouts it supports for them
+static bool vulkan_host_copy_general_supported(VkPhysicalDevice phdev) {
+	VkPhysicalDeviceHostImageCopyPropertiesEXT host_copy_props = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_IMAGE_COPY_PROPERTIES_EXT,
+	};
+	VkPhysicalDeviceProperties2 props = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+		.pNext = &host_copy_props,
+	};
+	vkGetPhysicalDeviceProperties2(phdev, &props);
+
+	VkImageLayout *src_layouts = calloc(host_copy_props.copySrcLayoutCount + 1, sizeof(*src_layouts));
+	VkImageLayout *dst_layouts = calloc(host_copy_props.copyDstLayoutCount + 1, sizeof(*dst_layouts));
+	bool supported = false;
+	if (src_layouts != NULL && dst_layouts != NULL) {
+		host_copy_props.pCopySrcLayouts = src_layouts;
+		host_copy_props.pCopyDstLayouts = dst_layouts;
+		vkGetPhysicalDeviceProperties2(phdev, &props);
+		supported = host_copy_layouts_contain(src_layouts, host_copy_props.copySrcLayoutCount,
+				VK_IMAGE_LAYOUT_GENERAL) &&
+			host_copy_layouts_contain(dst_layouts, host_copy_props.copyDstLayoutCount,
+				VK_IMAGE_LAYOUT_GENERAL);
+	}
+	free(src_layouts);
+	free(dst_layouts);
+	if (!supported) {
+		fprintf(stderr, "Host image copy does not support the general layout, not using it\n");
+	}
+	return supported;
+}
+
+static bool query_modifier_host_copy_support(VkPhysicalDevice phdev, VkFormat vk_format,
+		const struct vulkan_format_modifier_props *mod) {
+	// Aux and metadata planes may not survive the transition out of the
+	// undefined layout, see gbm_vulkan_bo_get_transfer
+	if (mod->props.drmFormatModifierPlaneCount != 1) {
+		return false;
+	}
+	VkPhysicalDeviceImageDrmFormatModifierInfoEXT modi = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT,
+		.drmFormatModifier = mod->props.drmFormatModifier,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+	};
+	VkPhysicalDeviceExternalImageFormatInfo efmti = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_IMAGE_FORMAT_INFO,
+		.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+		.pNext = &modi,
+	};
+	// Same usage as the transfer image of a BO, see gbm_vulkan_bo_get_transfer
+	VkPhysicalDeviceImageFormatInfo2 fmti = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2,
+		.type = VK_IMAGE_TYPE_2D,
+		.format = vk_format,
+		.usage = vulkan_modifier_transfer_usage(mod) | VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT,
+		.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT,
+		.pNext = &efmti,
+	};
+	VkImageFormatProperties2 ifmtp = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2,
+	};
+	return vkGetPhysicalDeviceImageFormatProperties2(phdev, &fmti, &ifmtp) == VK_SUCCESS;
+}
+
+static void vulkan_format_props_query_host_copy(VkPhysicalDevice phdev,
+		struct vulkan_format_props *props) {
+	for (uint32_t i = 0; i < props->render_mod_count; ++i) {
+		props->render_mods[i].host_copy = query_modifier_host_copy_support(phdev,
+			props->format.vk, &props->render_mods[i]);
+	}
+	for (uint32_t i = 0; i < props->texture_mod_count; ++i) {
+		props->texture_mods[i].host_copy = query_modifier_host_copy_support(phdev,
+			props->format.vk, &props->texture_mods[i]);
+	}
+}
+
+// Marks a modifier as supported by our own planes, or by those of the
+// PRIME display device if prime is set
+static void vulkan_mark_scanout_modifier(struct gbm_vulkan_device *dev,
+		uint32_t format, uint64_t modifier, bool prime) {
+	struct vulkan_format_props *props = vulkan_format_props_from_drm(dev, format);
+	if (props == NULL) {
+		return;
+	}
+	for (uint32_t i = 0; i < props->render_mod_count; ++i) {
+		if (props->render_mods[i].props.drmFormatModifier == modifier) {
+			*(prime ? &props->render_mods[i].prime : &props->render_mods[i].scanout) = true;
+		}
+	}
+	for (uint32_t i = 0; i < props->texture_mod_count; ++i) {
+		if (props->texture_mods[i].props.drmFormatModifier == modifier) {
+			*(prime ? &props->texture_mods[i].prime : &props->texture_mods[i].scanout) = true;
+		}
+	}
+}
+
+static bool kms_plane_read_in_formats(struct gbm_vulkan_device *dev, int fd, uint32_t plane_id,
+		bool prime) {
+	drmModeObjectProperties *props = drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	if (props == NULL) {
+		return false;
+	}
+
+	bool found = false;
+	for (uint32_t i = 0; i < props->count_props; i++) {
+		drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[i]);
+		if (prop == NULL) {
+			continue;
+		}
+		bool is_in_formats = strcmp(prop->name, "IN_FORMATS") == 0;
+		drmModeFreeProperty(prop);
+		if (!is_in_formats) {
+			continue;
+		}
+
+		drmModePropertyBlobRes *blob = drmModeGetPropertyBlob(fd, props->prop_values[i]);
+		if (blob == NULL) {
+			break;
+		}
+		drmModeFormatModifierIterator iter = {0};
+		while (drmModeFormatModifierBlobIterNext(blob, &iter)) {
+			vulkan_mark_scanout_modifier(dev, iter.fmt, iter.mod, prime);
+		}
+		drmModeFreePropertyBlob(blob);
+		found = true;
+		break;
+	}
+
+	drmModeFreeObjectProperties(props);
+	return found;
+}
+
+// Reads the formats and modifiers of the KMS planes of the device at path,
+// and returns whether it has any planes
+static bool vulkan_read_plane_formats(struct gbm_vulkan_device *dev, const char *path, bool prime) {
+	int kms_fd = open(path, O_RDWR | O_CLOEXEC);
+	if (kms_fd == -1) {
+		fprintf(stderr, "Could not open KMS device %s for plane formats\n", path);
+		return false;
+	}
+	if (drmSetClientCap(kms_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) != 0) {
+		close(kms_fd);
+		return false;
+	}
+
+	drmModePlaneRes *planes = drmModeGetPlaneResources(kms_fd);
+	if (planes == NULL) {
+		close(kms_fd);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < planes->count_planes; i++) {
+		if (kms_plane_read_in_formats(dev, kms_fd, planes->planes[i], prime)) {
+			continue;
+		}
+
+		// Planes without IN_FORMATS only take the implicit modifier, which
+		// is as good as linear for buffers shared with other devices.
+		drmModePlane *plane = drmModeGetPlane(kms_fd, planes->planes[i]);
+		if (plane == NULL) {
+			continue;
+		}
+		for (uint32_t j = 0; j < plane->count_formats; j++) {
+			vulkan_mark_scanout_modifier(dev, plane->formats[j], DRM_FORMAT_MOD_LINEAR, prime);
+		}
+		drmModeFreePlane(plane);
+	}
+
+	bool found = planes->count_planes > 0;
+	fprintf(stderr, "Read scanout formats from %"PRIu32" KMS planes of %s\n",
+		planes->count_planes, path);
+	drmModeFreePlaneResources(planes);
+	close(kms_fd);
+	return found;
+}
+
+static void vulkan_query_scanout_formats(struct gbm_vulkan_device *dev) {
+	// The PRIME display device scans out what we allocate for it, so its
+	// planes decide the modifiers of those BOs
+	if (dev->prime_display) {
+		dev->has_prime_scanout_info = vulkan_read_plane_formats(dev, dev->prime_path, true);
+	}
+
+	int fd = dev->base.v0.fd;
+	if (drmGetNodeTypeFromFd(fd) != DRM_NODE_PRIMARY) {
+		return;
+	}
+
+	// Use our own file description, so that enabling universal planes does
+	// not change what the caller sees when enumerating planes on theirs.
+	char *path = drmGetDeviceNameFromFd2(fd);
+	if (path == NULL) {
+		return;
+	}
+	dev->has_scanout_info = vulkan_read_plane_formats(dev, path, false);
+	free(path);
+}
+
+static void vulkan_trace_init(void) {
+	const char *env = getenv("GBM_VULKAN_TRACE");
+	if (env == NULL || env[0] == '\0' || strcmp(env, "0") == 0) {
+		return;
+	}
+#if VULKAN_GBM_TRACING
+	if (atomic_load(&vulkan_trace_fd) >= 0) {
+		return;
+	}
+	static const char *const dirs[] = {
+		"/sys/kernel/tracing",
+		"/sys/kernel/debug/tracing",
+	};
+	int fd = -1;
+	size_t idx;
+	for (idx = 0; idx < ARRAY_SIZE(dirs); idx++) {
+		char path[64];
+		snprintf(path, sizeof(path), "%s/trace_marker", dirs[idx]);
+		fd = open(path, O_WRONLY | O_CLOEXEC);
+		if (fd != -1) {
+			break;
+		}
+	}
+	if (fd == -1) {
+		fprintf(stderr, "Could not open ftrace trace_marker: %s\n", strerror(errno));
+		return;
+	}
+	// Without tracing_on, events are written whenever the marker is open
+	char path[64];
+	snprintf(path, sizeof(path), "%s/tracing_on", dirs[idx]);
+	int on_fd = open(path, O_RDONLY | O_CLOEXEC);
+	int expected = -1;
+	if (on_fd != -1 && !atomic_compare_exchange_strong(&vulkan_trace_on_fd, &expected, on_fd)) {
+		close(on_fd);
+	}
+	expected = -1;
+	if (!atomic_compare_exchange_strong(&vulkan_trace_fd, &expected, fd)) {
+		// Another device got there first
+		close(fd);
+	}
+#else
+	fprintf(stderr, "Ignoring GBM_VULKAN_TRACE, built without tracing\n");
+#endif
+}
+
+static void vulkan_parse_stats(struct gbm_vulkan_device *dev) {
+	const char *env = getenv("GBM_VULKAN_STATS");
+	if (env == NULL || env[0] == '\0') {
+		return;
+	}
+	char *end;
+	unsigned long interval = strtoul(env, &end, 10);
+	if (*end != '\0') {
+		fprintf(stderr, "Ignoring invalid GBM_VULKAN_STATS '%s'\n", env);
+		return;
+	}
+	dev->stats.dump = true;
+	dev->stats.dump_interval_ns = (uint64_t)interval * 1000000000ull;
+	dev->stats.next_dump_ns = get_time_ns() + dev->stats.dump_interval_ns;
+}
+
+static void vulkan_parse_prime_display(struct gbm_vulkan_device *dev) {
+	const char *path = getenv("GBM_VULKAN_PRIME_DISPLAY");
+	if (path == NULL || path[0] == '\0') {
+		return;
+	}
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISCHR(st.st_mode)) {
+		fprintf(stderr, "Ignoring invalid GBM_VULKAN_PRIME_DISPLAY '%s'\n", path);
+		return;
+	}
+	char *prime_path = strdup(path);
+	if (prime_path == NULL) {
+		return;
+	}
+	dev->prime_display = true;
+	dev->prime_devid = st.st_rdev;
+	dev->prime_path = prime_path;
+}
+
+static void vulkan_parse_surface_buffers(struct gbm_vulkan_device *dev) {
+	dev->surface_buffers = VULKAN_SURFACE_DEFAULT_BUFFERS;
+	const char *env = getenv("GBM_VULKAN_SURFACE_BUFFERS");
+	if (env == NULL || env[0] == '\0') {
+		return;
+	}
+	char *end;
+	unsigned long buffers = strtoul(env, &end, 10);
+	if (*end != '\0' || buffers < 2 || buffers > VULKAN_SURFACE_MAX_BUFFERS) {
+		fprintf(stderr, "Ignoring invalid GBM_VULKAN_SURFACE_BUFFERS '%s', expected 2 to %d\n",
+			env, VULKAN_SURFACE_MAX_BUFFERS);
+		return;
+	}
+	dev->surface_buffers = buffers;
+}
+
+static void vulkan_parse_warm_budget(struct gbm_vulkan_device *dev) {
+	uint64_t budget_mib = VULKAN_WARM_DEFAULT_BUDGET_MIB;
+	const char *env = getenv("GBM_VULKAN_WARM_POOL");
+	if (env != NULL && env[0] != '\0') {
+		char *end;
+		unsigned long long value = strtoull(env, &end, 10);
+		if (*end != '\0') {
+			fprintf(stderr, "Ignoring invalid GBM_VULKAN_WARM_POOL '%s'\n", env);
+		} else {
+			budget_mib = value;
+		}
+	}
+	dev->warm.budget = budget_mib << 20;
+}
+
+static void vulkan_open_dma_heap(struct gbm_vulkan_device *dev) {
+	const char *heap = getenv("GBM_VULKAN_DMA_HEAP");
+	if (heap == NULL || heap[0] == '\0') {
+		return;
+	}
+
+	char path[256];
+	snprintf(path, sizeof(path), "/dev/dma_heap/%s", heap);
+	dev->dma_heap_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (dev->dma_heap_fd == -1) {
+		fprintf(stderr, "Could not open DMA-BUF heap %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	static const struct {
+		const char *name;
+		uint32_t usage;
+	} usage_names[] = {
+		{ "scanout", GBM_BO_USE_SCANOUT },
+		{ "cursor", GBM_BO_USE_CURSOR },
+		{ "rendering", GBM_BO_USE_RENDERING },
+		{ "linear", GBM_BO_USE_LINEAR },
+	};
+
+	const char *env = getenv("GBM_VULKAN_DMA_HEAP_USAGE");
+	if (env == NULL || env[0] == '\0') {
+		env = "linear";
+	}
+	const char *cur = env;
+	while (*cur != '\0') {
+		size_t len = strcspn(cur, ",");
+		bool matched = false;
+		if (len == strlen("sampled") && strncmp(cur, "sampled", len) == 0) {
+			dev->dma_heap_sampled = true;
+			matched = true;
+		}
+		for (size_t i = 0; i < ARRAY_SIZE(usage_names) && !matched; i++) {
+			if (strlen(usage_names[i].name) == len && strncmp(cur, usage_names[i].name, len) == 0) {
+				dev->dma_heap_usage |= usage_names[i].usage;
+				matched = true;
+			}
+		}
+		if (!matched) {
+			fprintf(stderr, "Ignoring unknown usage '%.*s' in GBM_VULKAN_DMA_HEAP_USAGE\n",
+				(int)len, cur);
+		}
+		cur += len;
+		if (*cur == ',') {
+			cur++;
+		}
+	}
+	fprintf(stderr, "Using DMA-BUF heap %s for linear BOs\n", path);
+}
+
 static void vulkan_destroy(struct gbm_device *gbm) {
 	struct gbm_vulkan_device *vulkan = gbm_vulkan_device(gbm);
 	if (vulkan == NULL) {
 		return;
 	}
+	vulkan_warm_pool_finish(vulkan);
+	if (vulkan->reclaimer.enabled) {
+		vulkan_reclaimer_finish(vulkan);
+	}
+	// BOs still alive at this point were leaked by the client
+	if (vulkan->stats.dump) {
+		vulkan_stats_dump(vulkan);
+	}
+	if (vulkan->dma_heap_fd >= 0) {
+		close(vulkan->dma_heap_fd);
+	}
+	if (vulkan->udmabuf_fd >= 0) {
+		close(vulkan->udmabuf_fd);
+	}
+	if (vulkan->copy.enabled) {
+		vulkan_copy_engine_finish(vulkan);
+	}
+	vulkan_memory_cache_finish(vulkan);
 	if (vulkan->device) {
 		vkDestroyDevice(vulkan->device, NULL);
 	}
 	if (vulkan->instance) {
 		vkDestroyInstance(vulkan->instance, NULL);
 	}
+	pthread_mutex_destroy(&vulkan->copy_lock);
+	pthread_mutex_destroy(&vulkan->lock);
+	free(vulkan->prime_path);
 	free(vulkan);
 }
 
@@ -1255,7 +6002,10 @@ static void load_device_proc(struct gbm_vulkan_device *dev, const char *name, vo
 	*(PFN_vkVoidFunction *)proc_ptr = proc;
 }
 
-static VkPhysicalDevice vulkan_select_physical_device(VkInstance instance, int fd) {
+// Selects the device behind fd. If PRIME is enabled, also looks for the
+// display device, which is allowed to have no Vulkan driver.
+static VkPhysicalDevice vulkan_select_physical_device(struct gbm_vulkan_device *dev,
+		VkInstance instance, int fd) {
 	struct stat drm_stat = { 0 };
 	if (fstat(fd, &drm_stat) != 0) {
 		fprintf(stderr, "Could not fstat DRM fd\n");
@@ -1312,14 +6062,20 @@ static VkPhysicalDevice vulkan_select_physical_device(VkInstance instance, int f
 		dev_t render_devid = makedev(drm_props.renderMajor, drm_props.renderMinor);
 		if (primary_devid == drm_stat.st_rdev || render_devid == drm_stat.st_rdev) {
 			chosen = idx;
+			dev->devid = drm_props.hasRender ? render_devid : primary_devid;
+			if (dev->prime_display &&
+					(primary_devid == dev->prime_devid || render_devid == dev->prime_devid)) {
+				fprintf(stderr, "PRIME display device is the rendering device, disabling PRIME\n");
+				dev->prime_display = false;
+			}
 		}
 	}
 
-	if (chosen != -1) {
-		fprintf(stderr, "Selected device %d\n", chosen);
-		return phdevs[chosen];
+	if (chosen == -1) {
+		return VK_NULL_HANDLE;
 	}
-	return VK_NULL_HANDLE;
+	fprintf(stderr, "Selected device %d\n", chosen);
+	return phdevs[chosen];
 }
 
 static struct gbm_device *vulkan_device_create(int fd, uint32_t gbm_backend_version) {
@@ -1331,6 +6087,28 @@ static struct gbm_device *vulkan_device_create(int fd, uint32_t gbm_backend_vers
 	vulkan->base.v0.fd = fd;
 	vulkan->base.v0.backend_version = gbm_backend_version;
 	vulkan->base.v0.name = "vulkan";
+	vulkan->dma_heap_fd = -1;
+	vulkan->udmabuf_fd = -1;
+	pthread_mutex_init(&vulkan->copy_lock, NULL);
+	pthread_mutex_init(&vulkan->lock, NULL);
+	pthread_mutex_init(&vulkan->warm.lock, NULL);
+	pthread_mutex_init(&vulkan->memory_cache.lock, NULL);
+	pthread_condattr_t cond_attr;
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&vulkan->memory_cache.cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	pthread_cond_init(&vulkan->warm.cond, NULL);
+
+	const char *debug = getenv("GBM_VULKAN_DEBUG");
+	vulkan->debug = debug != NULL && strcmp(debug, "0") != 0;
+	vulkan_parse_modifier_policy(vulkan);
+	vulkan_parse_surface_buffers(vulkan);
+	vulkan_parse_warm_budget(vulkan);
+	vulkan_parse_prime_display(vulkan);
+	vulkan_parse_stats(vulkan);
+	vulkan_trace_init();
+	vulkan->convert_row = vulkan_select_convert_row();
 
 	vulkan->base.v0.destroy = vulkan_destroy;
 	vulkan->base.v0.is_format_supported = gbm_vulkan_is_format_supported;
@@ -1345,9 +6123,8 @@ static struct gbm_device *vulkan_device_create(int fd, uint32_t gbm_backend_vers
 	vulkan->base.v0.bo_get_stride = gbm_vulkan_bo_get_stride;
 	vulkan->base.v0.bo_get_offset = gbm_vulkan_bo_get_offset;
 	vulkan->base.v0.bo_get_modifier = gbm_vulkan_bo_get_modifier;
-	vulkan->base.v0.bo_destroy = gbm_vulkan_bo_destroy;
+	vulkan->base.v0.bo_destroy = gbm_vulkan_bo_reclaim;
 
-	// The methods below are not implemented
 	vulkan->base.v0.bo_import = gbm_vulkan_bo_import;
 	vulkan->base.v0.bo_map = gbm_vulkan_bo_map;
 	vulkan->base.v0.bo_unmap = gbm_vulkan_bo_unmap;
@@ -1363,7 +6140,7 @@ static struct gbm_device *vulkan_device_create(int fd, uint32_t gbm_backend_vers
 		.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
 		.pEngineName = "vulkan_gbm",
 		.engineVersion = VK_MAKE_VERSION(0, 1, 0),
-		.apiVersion = VK_API_VERSION_1_1,
+		.apiVersion = VK_API_VERSION_1_2,
 	};
 
 	VkInstanceCreateInfo createInfo = {
@@ -1378,38 +6155,153 @@ static struct gbm_device *vulkan_device_create(int fd, uint32_t gbm_backend_vers
 		return NULL;
 	}
 
-	vulkan->physical_device = vulkan_select_physical_device(vulkan->instance, fd);
+	vulkan->physical_device = vulkan_select_physical_device(vulkan, vulkan->instance, fd);
 	if (vulkan->physical_device == VK_NULL_HANDLE) {
 		fprintf(stderr, "Could not find candidate device\n");
 		vulkan_destroy(&vulkan->base);
 		return NULL;
 	}
 
-	const char *extensions[4] = { 0 };
+	uint32_t avail_extc = 0;
+	vkEnumerateDeviceExtensionProperties(vulkan->physical_device, NULL, &avail_extc, NULL);
+	VkExtensionProperties avail_ext_props[avail_extc + 1];
+	vkEnumerateDeviceExtensionProperties(vulkan->physical_device, NULL, &avail_extc, avail_ext_props);
+
+	const char *extensions[16] = { 0 };
 	size_t extensions_len = 0;
 	extensions[extensions_len++] = VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME;
 	extensions[extensions_len++] = VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME;
 	extensions[extensions_len++] = VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME;
 
+	// The copy engine needs timeline semaphores, and prefers handing BOs
+	// back to the foreign queue family when that is available
+	bool has_foreign = check_extension(avail_ext_props, avail_extc,
+		VK_EXT_QUEUE_FAMILY_FOREIGN_EXTENSION_NAME);
+	if (has_foreign) {
+		extensions[extensions_len++] = VK_EXT_QUEUE_FAMILY_FOREIGN_EXTENSION_NAME;
+	}
+	VkPhysicalDeviceTimelineSemaphoreFeatures timeline_features = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+	};
+	bool has_timeline = check_extension(avail_ext_props, avail_extc,
+		VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+	if (has_timeline) {
+		VkPhysicalDeviceFeatures2 features = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+			.pNext = &timeline_features,
+		};
+		vkGetPhysicalDeviceFeatures2(vulkan->physical_device, &features);
+		has_timeline = timeline_features.timelineSemaphore;
+	}
+	bool has_sync_fd = false;
+	if (check_extension(avail_ext_props, avail_extc, VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME)) {
+		VkPhysicalDeviceExternalSemaphoreInfo sem_info = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_SEMAPHORE_INFO,
+			.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT,
+		};
+		VkExternalSemaphoreProperties sem_props = {
+			.sType = VK_STRUCTURE_TYPE_EXTERNAL_SEMAPHORE_PROPERTIES,
+		};
+		vkGetPhysicalDeviceExternalSemaphoreProperties(vulkan->physical_device, &sem_info, &sem_props);
+		VkExternalSemaphoreFeatureFlags wanted = VK_EXTERNAL_SEMAPHORE_FEATURE_EXPORTABLE_BIT |
+			VK_EXTERNAL_SEMAPHORE_FEATURE_IMPORTABLE_BIT;
+		has_sync_fd = (sem_props.externalSemaphoreFeatures & wanted) == wanted;
+	}
+	if (has_sync_fd) {
+		extensions[extensions_len++] = VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME;
+	}
+	// Chain of the optional features we enable
+	void *features_next = NULL;
+	if (has_timeline) {
+		extensions[extensions_len++] = VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME;
+		timeline_features = (VkPhysicalDeviceTimelineSemaphoreFeatures){
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+			.pNext = features_next,
+			.timelineSemaphore = VK_TRUE,
+		};
+		features_next = &timeline_features;
+	} else {
+		fprintf(stderr, "Timeline semaphores not supported, GPU copies disabled\n");
+	}
+
+	VkPhysicalDeviceHostImageCopyFeaturesEXT host_copy_features = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_IMAGE_COPY_FEATURES_EXT,
+	};
+	vulkan->has_host_copy = check_extension(avail_ext_props, avail_extc,
+			VK_EXT_HOST_IMAGE_COPY_EXTENSION_NAME) &&
+		check_extension(avail_ext_props, avail_extc, VK_KHR_COPY_COMMANDS_2_EXTENSION_NAME) &&
+		check_extension(avail_ext_props, avail_extc, VK_KHR_FORMAT_FEATURE_FLAGS_2_EXTENSION_NAME);
+	if (vulkan->has_host_copy) {
+		VkPhysicalDeviceFeatures2 features = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+			.pNext = &host_copy_features,
+		};
+		vkGetPhysicalDeviceFeatures2(vulkan->physical_device, &features);
+		vulkan->has_host_copy = host_copy_features.hostImageCopy &&
+			vulkan_host_copy_general_supported(vulkan->physical_device);
+	}
+	if (vulkan->has_host_copy) {
+		extensions[extensions_len++] = VK_EXT_HOST_IMAGE_COPY_EXTENSION_NAME;
+		extensions[extensions_len++] = VK_KHR_COPY_COMMANDS_2_EXTENSION_NAME;
+		extensions[extensions_len++] = VK_KHR_FORMAT_FEATURE_FLAGS_2_EXTENSION_NAME;
+		host_copy_features = (VkPhysicalDeviceHostImageCopyFeaturesEXT){
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_IMAGE_COPY_FEATURES_EXT,
+			.pNext = features_next,
+			.hostImageCopy = VK_TRUE,
+		};
+		features_next = &host_copy_features;
+	}
+
+	VkPhysicalDeviceImageCompressionControlFeaturesEXT compression_features = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_COMPRESSION_CONTROL_FEATURES_EXT,
+	};
+	if (check_extension(avail_ext_props, avail_extc, VK_EXT_IMAGE_COMPRESSION_CONTROL_EXTENSION_NAME)) {
+		VkPhysicalDeviceFeatures2 features = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+			.pNext = &compression_features,
+		};
+		vkGetPhysicalDeviceFeatures2(vulkan->physical_device, &features);
+		vulkan->has_compression_control = compression_features.imageCompressionControl;
+	}
+	if (vulkan->has_compression_control) {
+		extensions[extensions_len++] = VK_EXT_IMAGE_COMPRESSION_CONTROL_EXTENSION_NAME;
+		compression_features = (VkPhysicalDeviceImageCompressionControlFeaturesEXT){
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_COMPRESSION_CONTROL_FEATURES_EXT,
+			.pNext = features_next,
+			.imageCompressionControl = VK_TRUE,
+		};
+		features_next = &compression_features;
+	}
+
 	const float prio = 1.f;
 	int queue_family_idx = vulkan_select_queue_family(vulkan->physical_device);
-	if (queue_family_idx == -1) {
+	int transfer_family_idx = vulkan_select_transfer_queue_family(vulkan->physical_device);
+	if (queue_family_idx == -1 || transfer_family_idx == -1) {
 		fprintf(stderr, "Could not pick queue family\n");
 		vulkan_destroy(&vulkan->base);
 		return NULL;
 	}
 
-	VkDeviceQueueCreateInfo qinfo = {
-		.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-		.queueFamilyIndex = queue_family_idx,
-		.queueCount = 1,
-		.pQueuePriorities = &prio,
+	VkDeviceQueueCreateInfo qinfos[2] = {
+		{
+			.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+			.queueFamilyIndex = queue_family_idx,
+			.queueCount = 1,
+			.pQueuePriorities = &prio,
+		},
+		{
+			.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+			.queueFamilyIndex = transfer_family_idx,
+			.queueCount = 1,
+			.pQueuePriorities = &prio,
+		},
 	};
 
 	VkDeviceCreateInfo dev_info = {
 		.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-		.queueCreateInfoCount = 1u,
-		.pQueueCreateInfos = &qinfo,
+		.pNext = features_next,
+		.queueCreateInfoCount = transfer_family_idx != queue_family_idx ? 2u : 1u,
+		.pQueueCreateInfos = qinfos,
 		.enabledExtensionCount = extensions_len,
 		.ppEnabledExtensionNames = extensions,
 	};
@@ -1421,8 +6313,34 @@ static struct gbm_device *vulkan_device_create(int fd, uint32_t gbm_backend_vers
 	}
 
 	load_device_proc(vulkan, "vkGetMemoryFdKHR", &vulkan->api.vkGetMemoryFdKHR);
+	load_device_proc(vulkan, "vkGetMemoryFdPropertiesKHR", &vulkan->api.vkGetMemoryFdPropertiesKHR);
 	load_device_proc(vulkan, "vkGetImageDrmFormatModifierPropertiesEXT",
 		&vulkan->api.vkGetImageDrmFormatModifierPropertiesEXT);
+	vkGetPhysicalDeviceMemoryProperties(vulkan->physical_device, &vulkan->mem_props);
+	VkPhysicalDeviceProperties phdev_props;
+	vkGetPhysicalDeviceProperties(vulkan->physical_device, &phdev_props);
+	vulkan->non_coherent_atom_size = phdev_props.limits.nonCoherentAtomSize;
+	vulkan->integrated = phdev_props.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU;
+	if (vulkan->has_host_copy) {
+		load_device_proc(vulkan, "vkCopyImageToMemoryEXT", &vulkan->api.vkCopyImageToMemoryEXT);
+		load_device_proc(vulkan, "vkCopyMemoryToImageEXT", &vulkan->api.vkCopyMemoryToImageEXT);
+		load_device_proc(vulkan, "vkTransitionImageLayoutEXT", &vulkan->api.vkTransitionImageLayoutEXT);
+	}
+	if (vulkan->has_compression_control) {
+		load_device_proc(vulkan, "vkGetImageSubresourceLayout2EXT",
+			&vulkan->api.vkGetImageSubresourceLayout2EXT);
+	}
+	if (has_timeline) {
+		load_device_proc(vulkan, "vkWaitSemaphoresKHR", &vulkan->api.vkWaitSemaphoresKHR);
+		if (has_sync_fd) {
+			load_device_proc(vulkan, "vkGetSemaphoreFdKHR", &vulkan->api.vkGetSemaphoreFdKHR);
+			load_device_proc(vulkan, "vkImportSemaphoreFdKHR", &vulkan->api.vkImportSemaphoreFdKHR);
+		}
+		if (vulkan_copy_engine_init(vulkan, transfer_family_idx, has_foreign, has_sync_fd) &&
+				vulkan->debug) {
+			fprintf(stderr, "Copy engine on queue family %d\n", transfer_family_idx);
+		}
+	}
 
 	vulkan->format_props = calloc(ARRAY_SIZE(formats), sizeof(*vulkan->format_props));
 	if (!vulkan->format_props) {
@@ -1434,6 +6352,28 @@ static struct gbm_device *vulkan_device_create(int fd, uint32_t gbm_backend_vers
 	for (unsigned i = 0u; i < ARRAY_SIZE(formats); ++i) {
 		vulkan_format_props_query(vulkan, vulkan->physical_device, &formats[i]);
 	}
+
+	if (vulkan->has_host_copy) {
+		for (uint32_t i = 0; i < vulkan->format_prop_count; ++i) {
+			vulkan_format_props_query_host_copy(vulkan->physical_device, &vulkan->format_props[i]);
+		}
+	}
+	vulkan_query_scanout_formats(vulkan);
+
+	vulkan_open_dma_heap(vulkan);
+
+	uint64_t has_dumb = 0;
+	vulkan->has_dumb = drmGetNodeTypeFromFd(fd) == DRM_NODE_PRIMARY &&
+		drmGetCap(fd, DRM_CAP_DUMB_BUFFER, &has_dumb) == 0 && has_dumb;
+
+	for (uint32_t i = 0; i < vulkan->format_prop_count; ++i) {
+		vulkan_format_props_compute_usage(vulkan, &vulkan->format_props[i]);
+	}
+
+	const char *deferred = getenv("GBM_VULKAN_DEFERRED_DESTROY");
+	if (deferred != NULL && strcmp(deferred, "0") != 0) {
+		vulkan_reclaimer_start(vulkan);
+	}
 	return &vulkan->base;
 }
 
@@ -0,0 +1,323 @@
+#ifndef GBM_VULKAN_H_
+#define GBM_VULKAN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <gbm.h>
+
+/**
+ * \file gbm_vulkan.h
+ * \brief Extensions specific to the Vulkan GBM backend
+ *
+ * Functions declared here are exported by the backend shared object, not by
+ * libgbm. As libgbm loads backends privately, clients look them up with
+ * dlsym() on a handle to the already loaded backend, e.g. from
+ * dlopen("vulkan_gbm.so", RTLD_NOW | RTLD_NOLOAD). The GBM objects passed to
+ * them must belong to a device created by this backend.
+ */
+
+/**
+ * Import type for gbm_bo_import() wrapping a region of shared memory, such
+ * as a wl_shm pool, without copying it. buffer points to a
+ * struct gbm_vulkan_import_shm_data.
+ *
+ * The memory is turned into a dma-buf through udmabuf, which requires the fd
+ * to be a memfd already sealed with F_SEAL_SHRINK; other fds fail with
+ * EINVAL. The resulting BO is linear and can be exported like any other BO.
+ */
+#define GBM_VULKAN_BO_IMPORT_SHM 0x5580
+
+struct gbm_vulkan_import_shm_data {
+	int fd;
+	uint32_t offset;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t format;
+};
+
+/**
+ * Asks the backend to create bo_count BOs as gbm_bo_create_with_modifiers2()
+ * would with the same arguments, on a background thread. Later calls with
+ * exactly these arguments are handed those BOs without waiting for an
+ * allocation, e.g. for the swapchain of a client that is about to resize.
+ *
+ * A new request replaces BOs created for an earlier one that were not taken
+ * yet. The number of BOs kept ready is capped, as is their total size, set
+ * in MiB with the GBM_VULKAN_WARM_POOL environment variable. Without it,
+ * this fails with ENOTSUP.
+ *
+ * \return 0 if the request was queued, -1 with errno set otherwise
+ */
+int gbm_vulkan_device_prewarm(struct gbm_device *gbm, uint32_t width, uint32_t height,
+		uint32_t format, const uint64_t *modifiers, unsigned count, uint32_t flags,
+		uint32_t bo_count);
+
+/**
+ * Largest bo_count gbm_vulkan_bo_create_batch() accepts
+ */
+#define GBM_VULKAN_BATCH_MAX_BOS 16
+
+/**
+ * Creates bo_count BOs as gbm_bo_create_with_modifiers2() would with the same
+ * arguments, and stores them in bos. The modifier is only negotiated once,
+ * and all BOs are guaranteed to have the same modifier and plane layout, as
+ * swapchains expect. On failure, no BOs are left allocated.
+ *
+ * \return 0 on success, -1 with errno set otherwise, EINVAL if bo_count is
+ * 0 or above GBM_VULKAN_BATCH_MAX_BOS
+ */
+int gbm_vulkan_bo_create_batch(struct gbm_device *gbm, uint32_t width, uint32_t height,
+		uint32_t format, const uint64_t *modifiers, unsigned count, uint32_t flags,
+		uint32_t bo_count, struct gbm_bo **bos);
+
+/**
+ * Creates a BO that shares the memory and dma-buf of bo but has a different
+ * format, without copying. format must be that of bo or its opaque variant,
+ * e.g. DRM_FORMAT_XRGB8888 for a DRM_FORMAT_ARGB8888 BO, so that a buffer
+ * can be scanned out while ignoring its alpha. The Vulkan image of the view
+ * can also be viewed as the sRGB variant of the format where the modifier of
+ * bo allows it. Where the driver cannot create an image for the view at all,
+ * it is only accessed through copies, like an imported BO.
+ *
+ * The view holds a reference on bo, which may be destroyed before it. Both
+ * are released with gbm_bo_destroy().
+ *
+ * \return The view, or NULL with errno set
+ */
+struct gbm_bo *gbm_vulkan_bo_create_view(struct gbm_bo *bo, uint32_t format);
+
+/**
+ * Let the driver decide whether to compress the BO
+ */
+#define GBM_VULKAN_COMPRESSION_DEFAULT 0
+/**
+ * The BO is not compressed, e.g. so that it can be shared with a device that
+ * does not understand the compression of the allocating GPU
+ */
+#define GBM_VULKAN_COMPRESSION_DISABLED 1
+/**
+ * The BO uses lossy fixed-rate compression, saving bandwidth for content
+ * where this is acceptable, such as video
+ */
+#define GBM_VULKAN_COMPRESSION_FIXED_RATE 2
+
+/**
+ * Like gbm_bo_create_with_modifiers2(), but with a GBM_VULKAN_COMPRESSION_*
+ * request. GBM_VULKAN_COMPRESSION_DISABLED also excludes modifiers that imply
+ * compression. Drivers may ignore GBM_VULKAN_COMPRESSION_FIXED_RATE, check
+ * gbm_vulkan_bo_get_compression() for what was applied.
+ *
+ * \return The BO, or NULL with errno set
+ */
+struct gbm_bo *gbm_vulkan_bo_create_with_compression(struct gbm_device *gbm,
+		uint32_t width, uint32_t height, uint32_t format, const uint64_t *modifiers,
+		unsigned count, uint32_t flags, uint32_t compression);
+
+/**
+ * Returns the GBM_VULKAN_COMPRESSION_* that applies to bo. For BOs that are
+ * compressed by the driver's choice, this is GBM_VULKAN_COMPRESSION_DEFAULT.
+ */
+uint32_t gbm_vulkan_bo_get_compression(struct gbm_bo *bo);
+
+/**
+ * Copies a width x height region from src at (src_x, src_y) to dst at
+ * (dst_x, dst_y) on the GPU, and waits for the copy to finish. Both BOs must
+ * belong to the same device and have the same format.
+ *
+ * \return 0 on success, -1 with errno set otherwise
+ */
+int gbm_vulkan_bo_copy(struct gbm_bo *dst, uint32_t dst_x, uint32_t dst_y,
+		struct gbm_bo *src, uint32_t src_x, uint32_t src_y,
+		uint32_t width, uint32_t height);
+
+/**
+ * Exports the fences currently attached to the dma-buf(s) of bo as a
+ * sync_file. With GBM_BO_TRANSFER_READ, the sync_file covers what a reader
+ * has to wait for, i.e. pending writes. With GBM_BO_TRANSFER_WRITE, it covers
+ * all pending access.
+ *
+ * \return A sync_file owned by the caller, or -1 with errno set
+ */
+int gbm_vulkan_bo_export_sync_file(struct gbm_bo *bo, uint32_t flags);
+
+/**
+ * Attaches sync_file to the dma-buf(s) of bo, so that implicitly synchronized
+ * users wait for it. flags take GBM_BO_TRANSFER_READ for work that reads the
+ * BO, GBM_BO_TRANSFER_WRITE for work that writes it. The caller keeps
+ * ownership of sync_file.
+ *
+ * \return 0 on success, -1 with errno set otherwise
+ */
+int gbm_vulkan_bo_import_sync_file(struct gbm_bo *bo, int sync_file, uint32_t flags);
+
+/**
+ * Like gbm_bo_map(), but presents the region in format instead of that of
+ * the BO, converting on map and unmap. Supported are the 32-bit RGB formats
+ * that differ from the BO's only in channel order, byte order (with
+ * DRM_FORMAT_BIG_ENDIAN) and whether alpha is used. Alpha reads as opaque
+ * when mapping a BO without alpha. The mapping is released with
+ * gbm_bo_unmap(). A mapping with only GBM_BO_TRANSFER_WRITE starts out
+ * zeroed and is converted back whole, so the caller has to write the
+ * entire region.
+ */
+void *gbm_vulkan_bo_map_format(struct gbm_bo *bo, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height, uint32_t flags, uint32_t format,
+		uint32_t *stride, void **map_data);
+
+/**
+ * Like gbm_bo_write(), but converts the data from format to that of the BO,
+ * as described for gbm_vulkan_bo_map_format(). buf holds tightly packed
+ * rows.
+ *
+ * \return 0 on success, -1 with errno set otherwise
+ */
+int gbm_vulkan_bo_write_format(struct gbm_bo *bo, const void *buf, size_t count, uint32_t format);
+
+/**
+ * gbm_bo_map() maps the BO memory itself rather than a copy of the region
+ */
+#define GBM_VULKAN_MEMORY_MAPPABLE (1 << 0)
+/**
+ * The mapped memory needs no cache maintenance. Without it, the backend
+ * invalidates and flushes the mapped range on map and unmap.
+ */
+#define GBM_VULKAN_MEMORY_COHERENT (1 << 1)
+/**
+ * CPU reads of the mapped memory are cached. Without it, the memory is
+ * write-combined or uncached and reading it is very slow. Mappings with
+ * only GBM_BO_TRANSFER_WRITE then return a zeroed bounce buffer that is
+ * streamed out whole on unmap, so the caller has to write the entire region.
+ */
+#define GBM_VULKAN_MEMORY_CACHED (1 << 2)
+
+/**
+ * Returns how gbm_bo_map() accesses bo, as GBM_VULKAN_MEMORY_* flags. 0
+ * means that maps go through a copy of the region. The copy of a map with
+ * only GBM_BO_TRANSFER_WRITE starts out zeroed and is written back whole
+ * on unmap, so the caller has to write the entire region.
+ */
+uint32_t gbm_vulkan_bo_get_memory_flags(struct gbm_bo *bo);
+
+/**
+ * The BO is backed by system memory rather than VRAM of the GPU
+ */
+#define GBM_VULKAN_BO_SYSTEM_MEMORY (1 << 0)
+/**
+ * The BO was allocated for scanout on the PRIME display device set with
+ * GBM_VULKAN_PRIME_DISPLAY, with a modifier its KMS planes take and in
+ * memory that device can access
+ */
+#define GBM_VULKAN_BO_PRIME (1 << 1)
+
+/**
+ * Returns the device number of the render node of the GPU that allocated or
+ * imported bo. If flags is not NULL, it is set to GBM_VULKAN_BO_* flags
+ * describing where the BO lives. GBM_VULKAN_BO_SYSTEM_MEMORY is only
+ * reported for BOs the backend allocated.
+ */
+dev_t gbm_vulkan_bo_get_device(struct gbm_bo *bo, uint32_t *flags);
+
+/**
+ * Operations whose latency struct gbm_vulkan_stats records: BO creation,
+ * import, gbm_bo_map() and dma-buf export through gbm_bo_get_fd() and
+ * gbm_bo_get_fd_for_plane()
+ */
+#define GBM_VULKAN_STATS_OP_CREATE 0
+#define GBM_VULKAN_STATS_OP_IMPORT 1
+#define GBM_VULKAN_STATS_OP_MAP 2
+#define GBM_VULKAN_STATS_OP_GET_FD 3
+#define GBM_VULKAN_STATS_OP_COUNT 4
+
+/**
+ * Bucket 0 of a latency histogram counts calls that took less than a
+ * microsecond, bucket i calls that took from 2^(i-1) up to 2^i
+ * microseconds. The last bucket also counts all slower calls.
+ */
+#define GBM_VULKAN_STATS_LATENCY_BUCKETS 20
+
+#define GBM_VULKAN_STATS_MAX_MEMORY_TYPES 32
+#define GBM_VULKAN_STATS_MAX_MEMORY_HEAPS 16
+
+/**
+ * Counters of a device since its creation. Memory is what the backend
+ * allocated for BOs, including memory of destroyed BOs that is kept for
+ * reuse. It is broken down by the Vulkan memory types and heaps of the
+ * device.
+ */
+struct gbm_vulkan_stats {
+	uint64_t live_bos;
+	uint64_t peak_live_bos;
+	uint64_t memory_bytes;
+	uint64_t peak_memory_bytes;
+	uint32_t memory_type_count;
+	uint32_t memory_heap_count;
+	uint64_t memory_type_bytes[GBM_VULKAN_STATS_MAX_MEMORY_TYPES];
+	uint64_t memory_heap_bytes[GBM_VULKAN_STATS_MAX_MEMORY_HEAPS];
+
+	uint64_t creates;
+	uint64_t imports;
+	uint64_t exports;
+	uint64_t maps;
+	uint64_t warm_pool_hits;
+	uint64_t warm_pool_misses;
+	uint64_t memory_cache_hits;
+	uint64_t memory_cache_misses;
+
+	uint64_t latency[GBM_VULKAN_STATS_OP_COUNT][GBM_VULKAN_STATS_LATENCY_BUCKETS];
+};
+
+/**
+ * Fills stats with the current counters of the device. Counters are updated
+ * without a common lock, so they are not guaranteed to be consistent with
+ * each other while other threads use the device.
+ */
+void gbm_vulkan_device_get_stats(struct gbm_device *gbm, struct gbm_vulkan_stats *stats);
+
+/**
+ * Returns the buffer of a surface to render into, for clients that do not
+ * render through EGL. The next gbm_surface_lock_front_buffer() returns it.
+ * Repeated calls return the same buffer until then.
+ *
+ * \return The back buffer, or NULL with errno set to EBUSY if every buffer
+ * is locked
+ */
+struct gbm_bo *gbm_vulkan_surface_get_back_buffer(struct gbm_surface *surface);
+
+struct gbm_vulkan_readback;
+
+/**
+ * Starts a GPU copy of a region of bo into a pooled host buffer and returns
+ * without waiting for it. Several readbacks can be in flight at once, up to
+ * a small limit after which this fails with EBUSY.
+ *
+ * If fence_fd is not NULL, it is set to a sync_file that signals once the
+ * data is ready. The caller owns the sync_file and can poll() it for
+ * POLLIN. It is set to -1 if the device cannot export one, which is the case
+ * for every readback on devices without VK_KHR_external_semaphore_fd or
+ * sync_fd semaphores. Callers then have to wait in
+ * gbm_vulkan_readback_map(), from a thread of their own if they must not
+ * block.
+ *
+ * \return The readback, or NULL with errno set
+ */
+struct gbm_vulkan_readback *gbm_vulkan_bo_readback(struct gbm_bo *bo,
+		uint32_t x, uint32_t y, uint32_t width, uint32_t height, int *fence_fd);
+
+/**
+ * Returns the tightly packed pixels of a readback, waiting for the copy if
+ * it has not completed yet. The data remains valid until the readback is
+ * released.
+ *
+ * \return The data, or NULL with errno set
+ */
+const void *gbm_vulkan_readback_map(struct gbm_vulkan_readback *readback, uint32_t *stride);
+
+/**
+ * Returns the buffer of a readback to the pool. Does not block, even if the
+ * copy is still in flight.
+ */
+void gbm_vulkan_readback_release(struct gbm_vulkan_readback *readback);
+
+#endif
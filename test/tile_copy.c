@@ -0,0 +1,149 @@
+// Round-trips rectangles through vulkan_tile_copy for the Intel X- and
+// Y-tiled layouts, checked against addresses computed by hand from the
+// tiling formats rather than with vulkan_tiled_offset itself.
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <drm_fourcc.h>
+
+#include "vulkan_tiling.h"
+
+#define STRIDE 1024
+#define ROWS 96
+
+static int failures;
+
+#define check(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		failures++; \
+	} \
+} while (0)
+
+// X tiles are 512 bytes by 8 rows, stored row after row
+static size_t x_tiled_offset(uint32_t x, uint32_t y) {
+	size_t tile = (size_t)(y / 8) * (STRIDE / 512) + x / 512;
+	return tile * 4096 + (y % 8) * 512 + x % 512;
+}
+
+// Y tiles are 128 bytes by 32 rows, stored as 8 columns of 16-byte spans
+static size_t y_tiled_offset(uint32_t x, uint32_t y) {
+	size_t tile = (size_t)(y / 32) * (STRIDE / 128) + x / 128;
+	return tile * 4096 + (x % 128 / 16) * 512 + (y % 32) * 16 + x % 16;
+}
+
+struct offset_case {
+	uint32_t x, y;
+	size_t offset;
+};
+
+static void check_offsets(const char *name, const struct vulkan_tile_layout *layout,
+		const struct offset_case *cases, size_t count) {
+	for (size_t idx = 0; idx < count; idx++) {
+		size_t offset = vulkan_tiled_offset(layout, STRIDE, cases[idx].x, cases[idx].y);
+		check(offset == cases[idx].offset, "%s: offset of (%"PRIu32", %"PRIu32") is %zu, expected %zu",
+			name, cases[idx].x, cases[idx].y, offset, cases[idx].offset);
+	}
+}
+
+static void check_round_trip(const char *name, const struct vulkan_tile_layout *layout,
+		size_t (*reference)(uint32_t x, uint32_t y),
+		uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+	size_t tiled_size = (size_t)STRIDE * ROWS;
+	// Linear buffers with a stride that is not a multiple of anything
+	uint32_t linear_stride = width + 13;
+	char *tiled = malloc(tiled_size);
+	char *src = malloc((size_t)linear_stride * height);
+	char *dst = calloc(height, linear_stride);
+	if (tiled == NULL || src == NULL || dst == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memset(tiled, 0xa5, tiled_size);
+	for (uint32_t row = 0; row < height; row++) {
+		for (uint32_t col = 0; col < width; col++) {
+			src[(size_t)row * linear_stride + col] = (char)(row * 31 + col * 7 + 1);
+		}
+	}
+
+	vulkan_tile_copy(layout, tiled, STRIDE, src, linear_stride, x, y, width, height, false);
+
+	size_t written = 0;
+	for (uint32_t row = 0; row < height; row++) {
+		for (uint32_t col = 0; col < width; col++) {
+			size_t offset = reference(x + col, y + row);
+			char expected = src[(size_t)row * linear_stride + col];
+			if (tiled[offset] != expected) {
+				check(false, "%s: byte (%"PRIu32", %"PRIu32") at %zu not tiled", name, x + col, y + row, offset);
+				goto out;
+			}
+			written++;
+		}
+	}
+	size_t untouched = 0;
+	for (size_t offset = 0; offset < tiled_size; offset++) {
+		untouched += tiled[offset] == (char)0xa5;
+	}
+	// Pattern bytes may happen to equal the fill value, so only bound it
+	check(untouched >= tiled_size - written, "%s: tiling wrote outside the rectangle", name);
+
+	vulkan_tile_copy(layout, tiled, STRIDE, dst, linear_stride, x, y, width, height, true);
+	for (uint32_t row = 0; row < height; row++) {
+		if (memcmp(dst + (size_t)row * linear_stride, src + (size_t)row * linear_stride, width) != 0) {
+			check(false, "%s: row %"PRIu32" differs after detiling", name, row);
+			goto out;
+		}
+	}
+
+out:
+	free(tiled);
+	free(src);
+	free(dst);
+}
+
+int main(void) {
+	const struct vulkan_tile_layout *x_tiled = vulkan_get_tile_layout(I915_FORMAT_MOD_X_TILED);
+	const struct vulkan_tile_layout *y_tiled = vulkan_get_tile_layout(I915_FORMAT_MOD_Y_TILED);
+	if (x_tiled == NULL || y_tiled == NULL || vulkan_get_tile_layout(DRM_FORMAT_MOD_LINEAR) != NULL) {
+		fprintf(stderr, "Unexpected tile layouts\n");
+		return 1;
+	}
+
+	static const struct offset_case x_cases[] = {
+		{ 0, 0, 0 },
+		{ 511, 0, 511 },
+		{ 512, 0, 4096 },
+		{ 0, 1, 512 },
+		{ 0, 8, 8192 },
+		{ 700, 9, 12988 },
+	};
+	static const struct offset_case y_cases[] = {
+		{ 0, 0, 0 },
+		{ 15, 0, 15 },
+		{ 16, 0, 512 },
+		{ 0, 1, 16 },
+		{ 128, 0, 4096 },
+		{ 0, 32, 32768 },
+		{ 200, 35, 38968 },
+	};
+	check_offsets("X", x_tiled, x_cases, sizeof(x_cases) / sizeof(x_cases[0]));
+	check_offsets("Y", y_tiled, y_cases, sizeof(y_cases) / sizeof(y_cases[0]));
+
+	// Aligned to tiles, then rectangles that start and end within spans
+	// and tiles, crossing tile rows
+	check_round_trip("X aligned", x_tiled, x_tiled_offset, 0, 0, STRIDE, 16);
+	check_round_trip("X unaligned", x_tiled, x_tiled_offset, 37, 5, 601, 41);
+	check_round_trip("X narrow", x_tiled, x_tiled_offset, 509, 7, 5, 3);
+	check_round_trip("Y aligned", y_tiled, y_tiled_offset, 0, 0, STRIDE, 64);
+	check_round_trip("Y unaligned", y_tiled, y_tiled_offset, 37, 5, 601, 41);
+	check_round_trip("Y narrow", y_tiled, y_tiled_offset, 13, 31, 7, 2);
+
+	if (failures > 0) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,90 @@
+#include <string.h>
+#include <drm_fourcc.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "vulkan_tiling.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+static const struct vulkan_tile_layout vulkan_tile_layouts[] = {
+	{
+		.modifier = I915_FORMAT_MOD_X_TILED,
+		.tile_width = 512,
+		.tile_height = 8,
+		.span_width = 512,
+	},
+	{
+		.modifier = I915_FORMAT_MOD_Y_TILED,
+		.tile_width = 128,
+		.tile_height = 32,
+		.span_width = 16,
+	},
+};
+
+const struct vulkan_tile_layout *vulkan_get_tile_layout(uint64_t modifier) {
+	for (size_t i = 0; i < ARRAY_SIZE(vulkan_tile_layouts); i++) {
+		if (vulkan_tile_layouts[i].modifier == modifier) {
+			return &vulkan_tile_layouts[i];
+		}
+	}
+	return NULL;
+}
+
+size_t vulkan_tiled_offset(const struct vulkan_tile_layout *layout, uint32_t stride,
+		uint32_t x_bytes, uint32_t y) {
+	size_t tiles_per_row = stride / layout->tile_width;
+	size_t tile = (size_t)(y / layout->tile_height) * tiles_per_row + x_bytes / layout->tile_width;
+	uint32_t tile_x = x_bytes % layout->tile_width;
+	uint32_t tile_y = y % layout->tile_height;
+	return tile * layout->tile_width * layout->tile_height +
+		(size_t)(tile_x / layout->span_width) * layout->span_width * layout->tile_height +
+		tile_y * layout->span_width + tile_x % layout->span_width;
+}
+
+// Copies within a span. Tiled memory is typically write-combined, where
+// streaming loads avoid the worst of uncached reads.
+static inline void copy_span(char *dst, const char *src, size_t len) {
+#if defined(__SSE4_1__)
+	if ((((uintptr_t)src) & 15) == 0) {
+		for (; len >= 16; len -= 16, src += 16, dst += 16) {
+			__m128i v = _mm_stream_load_si128((__m128i *)src);
+			_mm_storeu_si128((__m128i *)dst, v);
+		}
+	}
+#elif defined(__SSE2__)
+	for (; len >= 16; len -= 16, src += 16, dst += 16) {
+		_mm_storeu_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+	}
+#elif defined(__ARM_NEON)
+	for (; len >= 16; len -= 16, src += 16, dst += 16) {
+		vst1q_u8((uint8_t *)dst, vld1q_u8((const uint8_t *)src));
+	}
+#endif
+	memcpy(dst, src, len);
+}
+
+void vulkan_tile_copy(const struct vulkan_tile_layout *layout,
+		char *tiled, uint32_t tiled_stride, char *linear, uint32_t linear_stride,
+		uint32_t x_bytes, uint32_t y, uint32_t width_bytes, uint32_t height, bool detile) {
+	for (uint32_t row = 0; row < height; row++) {
+		char *line = linear + (size_t)row * linear_stride;
+		uint32_t pos = x_bytes;
+		uint32_t end = x_bytes + width_bytes;
+		while (pos < end) {
+			uint32_t span_end = (pos / layout->span_width + 1) * layout->span_width;
+			uint32_t len = (span_end < end ? span_end : end) - pos;
+			char *span = tiled + vulkan_tiled_offset(layout, tiled_stride, pos, y + row);
+			if (detile) {
+				copy_span(line + (pos - x_bytes), span, len);
+			} else {
+				copy_span(span, line + (pos - x_bytes), len);
+			}
+			pos += len;
+		}
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef VULKAN_TILING_H_
+#define VULKAN_TILING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Software (de)tiling for the tiled layouts whose addressing is simple
+// enough to do on the CPU through a mapping of the dma-buf. Tiles are laid
+// out row-major, and within a tile memory consists of spans of span_width
+// bytes that are stacked vertically, one column of spans after another.
+//
+// Internal to the backend, kept in its own translation unit so that it can
+// be tested without a device.
+struct vulkan_tile_layout {
+	uint64_t modifier;
+	uint32_t tile_width; // in bytes
+	uint32_t tile_height;
+	uint32_t span_width;
+};
+
+#define VULKAN_TILING_HIDDEN __attribute__((visibility("hidden")))
+
+// Returns the layout of a modifier, NULL if it cannot be (de)tiled on the CPU
+VULKAN_TILING_HIDDEN const struct vulkan_tile_layout *vulkan_get_tile_layout(uint64_t modifier);
+
+// Offset of a byte of the image in tiled memory with the given row stride
+VULKAN_TILING_HIDDEN size_t vulkan_tiled_offset(const struct vulkan_tile_layout *layout,
+		uint32_t stride, uint32_t x_bytes, uint32_t y);
+
+// Copies a rectangle between tiled memory and a linear buffer, in the
+// direction given by detile. x_bytes and width_bytes are in bytes.
+VULKAN_TILING_HIDDEN void vulkan_tile_copy(const struct vulkan_tile_layout *layout,
+		char *tiled, uint32_t tiled_stride, char *linear, uint32_t linear_stride,
+		uint32_t x_bytes, uint32_t y, uint32_t width_bytes, uint32_t height, bool detile);
+
+#endif